@@ -3,9 +3,18 @@
 Regularization parseRegularization(const std::string &regularization) {
     if (regularization == "none") return None;
     if (regularization == "local_smooth") return LocalSmooth;
+    if (regularization == "graph_smooth") return GraphSmooth;
     throw std::runtime_error("Invalid regularization value: " + regularization);
 }
 
+double smoothingExtent(const Regularization regularization, const double regRadius, const int smoothHops, const double startResolution) {
+    if (regularization == LocalSmooth) return regRadius;
+
+    // Nearest neighbors at the first scale are about two voxels away
+    if (regularization == GraphSmooth) return 2.0 * startResolution * smoothHops;
+    return 0.0;
+}
+
 ClassifierType fingerprint(const std::string &modelFile) {
     std::ifstream ifs(modelFile.c_str(), std::ios::binary);
     if (!ifs.is_open()) throw std::runtime_error("Cannot open " + modelFile);
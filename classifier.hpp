@@ -10,10 +10,14 @@
 #include "constants.hpp"
 #include "point_io.hpp"
 #include "statistics.hpp"
+#include "perfcounters.hpp"
 
-enum Regularization { None, LocalSmooth };
+enum Regularization { None, LocalSmooth, GraphSmooth };
 Regularization parseRegularization(const std::string &regularization);
 
+// Approximate distance over which regularization gathers values
+double smoothingExtent(Regularization regularization, double regRadius, int smoothHops, double startResolution);
+
 enum ClassifierType { RandomForest, GradientBoostedTrees };
 ClassifierType fingerprint(const std::string &modelFile);
 
@@ -25,6 +29,7 @@ void getTrainingData(const std::vector<std::string> &filenames,
     const double radius,
     const int maxSamples,
     const std::vector<int> &asprsClasses,
+    const unsigned int momentScales,
     F storeFeatures,
     I init) {
     auto labels = getTrainingLabels();
@@ -42,21 +47,23 @@ void getTrainingData(const std::vector<std::string> &filenames,
     }
 
     for (size_t i = 0; i < filenames.size(); i++) {
-        std::cout << "Processing " << filenames[i] << std::endl;
+        logStream() << "Processing " << filenames[i] << std::endl;
         auto pointSet = readPointSet(filenames[i]);
         if (!pointSet->hasLabels()) {
-            std::cout << filenames[i] << " has no labels, skipping..." << std::endl;
+            logStream() << filenames[i] << " has no labels, skipping..." << std::endl;
             continue;
         }
 
         if (*startResolution == -1.0) {
             *startResolution = pointSet->spacing(); // meters
-            std::cout << "Starting resolution: " << *startResolution << std::endl;
+            logStream() << "Starting resolution: " << *startResolution << std::endl;
         }
 
-        auto scales = computeScales(numScales, pointSet, *startResolution, radius);
+        ScaleOptions scaleOptions;
+        scaleOptions.momentScales = momentScales;
+        auto scales = computeScales(numScales, pointSet, *startResolution, radius, scaleOptions);
         auto features = getFeatures(scales);
-        std::cout << "Features: " << features.size() << std::endl;
+        logStream() << "Features: " << features.size() << std::endl;
 
         if (i == 0) init(features.size(), labels.size());
 
@@ -85,7 +92,7 @@ void getTrainingData(const std::vector<std::string> &filenames,
         samplesPerLabel = std::min<size_t>(samplesPerLabel, maxSamples);
         std::vector<std::size_t> added(labels.size(), 0);
 
-        std::cout << "Samples per label: " << samplesPerLabel << std::endl;
+        logStream() << "Samples per label: " << samplesPerLabel << std::endl;
 
         std::random_device rd;
         std::mt19937 ranGen(rd());
@@ -101,7 +108,7 @@ void getTrainingData(const std::vector<std::string> &filenames,
         }
 
         for (std::size_t i = 0; i < labels.size(); i++)
-            std::cout << " * " << labels[i].getName() << ": " << added[i] << " / " << count[i] << std::endl;
+            logStream() << " * " << labels[i].getName() << ": " << added[i] << " / " << count[i] << std::endl;
 
         // Free up memory for next
         for (size_t i = 0; i < scales.size(); i++) delete scales[i];
@@ -110,6 +117,38 @@ void getTrainingData(const std::vector<std::string> &filenames,
     }
 }
 
+inline uint8_t quantizeProbability(const float p) {
+    return static_cast<uint8_t>(std::lround(std::min(std::max(p, 0.f), 1.f) * 255.f));
+}
+
+// Store the quantized top-1 probability, the margin to the
+// second best class and optionally all class probabilities
+template <typename T>
+void storeConfidence(PointSet &pSet, const size_t i, const T *probs, const size_t numLabels,
+    const bool confidence, const bool probabilities) {
+    if (confidence) {
+        T first = 0., second = 0.;
+        for (std::size_t j = 0; j < numLabels; j++) {
+            if (probs[j] > first) {
+                second = first;
+                first = probs[j];
+            }
+            else if (probs[j] > second) {
+                second = probs[j];
+            }
+        }
+
+        pSet.confidence[i] = { quantizeProbability(first), quantizeProbability(first - second) };
+    }
+
+    if (probabilities) {
+        uint8_t *dst = &pSet.probabilities[i * numLabels];
+        for (std::size_t j = 0; j < numLabels; j++) {
+            dst[j] = quantizeProbability(probs[j]);
+        }
+    }
+}
+
 template <typename T, typename F>
 void classifyData(PointSet &pointSet,
     F evaluateFunc,
@@ -121,19 +160,34 @@ void classifyData(PointSet &pointSet,
     const bool unclassifiedOnly,
     const bool evaluate,
     const std::vector<int> &skip,
-    const std::string &statsFile) {
+    const std::string &statsFile,
+    const bool confidence,
+    const bool probabilities,
+    const int smoothHops) {
 
-    std::cout << "Classifying..." << std::endl;
+    logStream() << "Classifying..." << std::endl;
     pointSet.base->labels.resize(pointSet.base->count());
 
-    if (regularization == Regularization::None) {
+    const size_t numLabels = labels.size();
+    if (confidence) pointSet.base->confidence.resize(pointSet.base->count());
+    if (probabilities) pointSet.base->probabilities.resize(pointSet.base->count() * numLabels);
+
+    const size_t evalCount = pointSet.base->evalCount();
+
+    if (evalCount == 0) {
+        logStream() << "No points to classify" << std::endl;
+    }
+    else if (regularization == Regularization::None) {
+        perfBeginStage("inference");
+
         #pragma omp parallel
         {
             std::vector<T> probs(labels.size(), 0.);
             std::vector<T> ft(features.size());
 
             #pragma omp for
-            for (long long int i = 0; i < pointSet.base->count(); i++) {
+            for (long long int k = 0; k < pointSet.base->evalCount(); k++) {
+                const size_t i = pointSet.base->evalPoint(k);
                 for (std::size_t f = 0; f < features.size(); f++) {
                     ft[f] = features[f]->getValue(i);
                 }
@@ -152,12 +206,23 @@ void classifyData(PointSet &pointSet,
                 }
 
                 pointSet.base->labels[i] = bestClass;
+                storeConfidence(*pointSet.base, i, probs.data(), numLabels, confidence, probabilities);
             }
         } // end pragma omp
 
+        perfEndStage("inference", evalCount);
     }
-    else if (regularization == Regularization::LocalSmooth) {
-        std::vector<std::vector<T> > values(labels.size(), std::vector<T>(pointSet.base->count(), -1.));
+    else if (regularization == Regularization::LocalSmooth || regularization == Regularization::GraphSmooth) {
+        if (regularization == Regularization::GraphSmooth && !pointSet.base->hasGraph()) {
+            throw std::runtime_error("Graph smoothing requires the nearest neighbors graph of the first scale");
+        }
+
+        // Graph smoothing reads all probabilities of a neighbor at once (point-major),
+        // local smoothing uses label-major values. Only one of the two is allocated
+        const bool pointMajor = regularization == Regularization::GraphSmooth;
+        std::vector<std::vector<T> > values(pointMajor ? 0 : labels.size(), std::vector<T>(pointSet.base->count(), -1.));
+        std::vector<T> cur(pointMajor ? pointSet.base->count() * numLabels : 0, -1.);
+        perfBeginStage("inference");
 
         #pragma omp parallel
         {
@@ -166,44 +231,71 @@ void classifyData(PointSet &pointSet,
             std::vector<T> ft(features.size());
 
             #pragma omp for
-            for (long long int i = 0; i < pointSet.base->count(); i++) {
+            for (long long int k = 0; k < pointSet.base->evalCount(); k++) {
+                const size_t i = pointSet.base->evalPoint(k);
                 for (std::size_t f = 0; f < features.size(); f++) {
                     ft[f] = features[f]->getValue(i);
                 }
 
                 evaluateFunc(ft.data(), probs.data());
 
-                for (std::size_t j = 0; j < labels.size(); j++) {
-                    values[j][i] = probs[j];
+                if (pointMajor) {
+                    std::copy(probs.begin(), probs.end(), &cur[i * numLabels]);
+                }
+                else {
+                    for (std::size_t j = 0; j < labels.size(); j++) {
+                        values[j][i] = probs[j];
+                    }
                 }
             }
 
         }
 
-        std::cout << "Local smoothing..." << std::endl;
+        perfEndStage("inference", evalCount);
+        perfBeginStage("smoothing");
 
-        #pragma omp parallel
-        {
+        if (regularization == Regularization::GraphSmooth) {
+            logStream() << "Graph smoothing..." << std::endl;
+            const PointSet &base = *pointSet.base;
+
+            // Each pass averages a point's probabilities with those
+            // of its kNN neighbors from the previous pass
+            std::vector<T> next(base.count() * numLabels, -1.);
+
+            for (int hop = 0; hop < smoothHops; hop++) {
+                #pragma omp parallel for
+                for (long long int k = 0; k < base.evalCount(); k++) {
+                    const size_t i = base.evalPoint(k);
+                    T *mean = &next[i * numLabels];
+                    std::fill(mean, mean + numLabels, 0.);
+                    size_t numMatches = 0;
 
-            std::vector<nanoflann::ResultItem<size_t, float>> radiusMatches;
-            std::vector<T> mean(values.size(), 0.);
-            const auto index = pointSet.base->getIndex<KdTree>();
+                    for (size_t n = base.graphOffsets[i]; n < base.graphOffsets[i + 1]; n++) {
+                        const T *nProbs = &cur[static_cast<size_t>(base.graphNeighbors[n]) * numLabels];
 
-            #pragma omp for schedule(dynamic, 1)
-            for (long long int i = 0; i < pointSet.base->count(); i++) {
-                size_t numMatches = index->radiusSearch(&pointSet.base->points[i][0], regRadius, radiusMatches);
-                std::fill(mean.begin(), mean.end(), 0.);
+                        // Skip neighbors that have not been evaluated
+                        if (nProbs[0] < 0) continue;
 
-                for (size_t n = 0; n < numMatches; n++) {
-                    for (std::size_t j = 0; j < values.size(); ++j) {
-                        mean[j] += values[j][radiusMatches[n].first];
+                        for (std::size_t j = 0; j < numLabels; j++) mean[j] += nProbs[j];
+                        numMatches++;
                     }
+
+                    // Fallback for points whose neighbors were all skipped
+                    if (numMatches == 0) std::copy(&cur[i * numLabels], &cur[i * numLabels] + numLabels, mean);
+                    else for (std::size_t j = 0; j < numLabels; j++) mean[j] /= numMatches;
                 }
 
+                cur.swap(next);
+            }
+
+            #pragma omp parallel for
+            for (long long int k = 0; k < base.evalCount(); k++) {
+                const size_t i = base.evalPoint(k);
+                const T *mean = &cur[i * numLabels];
+
                 int bestClass = 0;
                 T bestClassVal = 0.f;
-                for (std::size_t j = 0; j < mean.size(); j++) {
-                    mean[j] /= numMatches;
+                for (std::size_t j = 0; j < numLabels; j++) {
                     if (mean[j] > bestClassVal) {
                         bestClassVal = mean[j];
                         bestClass = j;
@@ -211,15 +303,64 @@ void classifyData(PointSet &pointSet,
                 }
 
                 pointSet.base->labels[i] = bestClass;
+                storeConfidence(*pointSet.base, i, mean, numLabels, confidence, probabilities);
             }
+        }
+        else {
+            logStream() << "Local smoothing..." << std::endl;
+            omp_set_schedule(tuning().smoothSchedule, tuning().smoothChunk);
+
+            #pragma omp parallel
+            {
+
+                std::vector<nanoflann::ResultItem<size_t, float>> radiusMatches;
+                std::vector<T> mean(values.size(), 0.);
+                const auto index = pointSet.base->getIndex<KdTree>();
+
+                #pragma omp for schedule(runtime)
+                for (long long int k = 0; k < pointSet.base->evalCount(); k++) {
+                    const size_t i = pointSet.base->evalPoint(k);
+                    const size_t numRadiusMatches = index->radiusSearch(&pointSet.base->points[i][0], regRadius, radiusMatches);
+                    std::fill(mean.begin(), mean.end(), 0.);
+                    size_t numMatches = 0;
+
+                    for (size_t n = 0; n < numRadiusMatches; n++) {
+                        const size_t nIdx = radiusMatches[n].first;
+
+                        // Skip neighbors that have not been evaluated
+                        if (values[0][nIdx] < 0) continue;
+
+                        for (std::size_t j = 0; j < values.size(); ++j) {
+                            mean[j] += values[j][nIdx];
+                        }
+                        numMatches++;
+                    }
+
+                    int bestClass = 0;
+                    T bestClassVal = 0.f;
+                    for (std::size_t j = 0; j < mean.size(); j++) {
+                        mean[j] /= numMatches;
+                        if (mean[j] > bestClassVal) {
+                            bestClassVal = mean[j];
+                            bestClass = j;
+                        }
+                    }
 
+                    pointSet.base->labels[i] = bestClass;
+                    storeConfidence(*pointSet.base, i, mean.data(), numLabels, confidence, probabilities);
+                }
+
+            }
         }
+
+        perfEndStage("smoothing", evalCount);
     }
     else {
         throw std::runtime_error("Invalid regularization");
     }
 
     if (!useColors && !pointSet.hasLabels()) pointSet.labels.resize(pointSet.count());
+    if (useColors) pointSet.colorsModified = true;
     std::vector<bool> skipMap(255, false);
     for (size_t i = 0; i < skip.size(); i++) {
         const int skipClass = skip[i];
@@ -228,20 +369,41 @@ void classifyData(PointSet &pointSet,
 
     auto train2asprsCodes = getTrain2AsprsCodes();
 
+    // Base points outside of the evaluated subset have no label
+    std::vector<uint8_t> evaluated;
+    if (pointSet.base->evalSubset) {
+        evaluated.resize(pointSet.base->count(), 0);
+        for (const size_t idx : pointSet.base->evalIdx) evaluated[idx] = 1;
+    }
+
     Statistics stats(labels);
 
+    if (confidence) pointSet.confidence.resize(pointSet.count());
+    if (probabilities) {
+        pointSet.probabilities.resize(pointSet.count() * numLabels);
+        pointSet.probabilityLabels.clear();
+        for (const auto &l : labels) pointSet.probabilityLabels.push_back(l.getName());
+    }
+
     #pragma omp parallel for
     for (long long int i = 0; i < pointSet.count(); i++) {
         const size_t idx = pointSet.pointMap[i];
 
         const int bestClass = pointSet.base->labels[idx];
         auto label = labels[bestClass];
+        const bool isEvaluated = evaluated.empty() || evaluated[idx];
+
+        if (confidence) pointSet.confidence[i] = pointSet.base->confidence[idx];
+        if (probabilities) {
+            std::copy_n(&pointSet.base->probabilities[idx * numLabels], numLabels,
+                &pointSet.probabilities[i * numLabels]);
+        }
 
-        if (evaluate) {
+        if (evaluate && isEvaluated) {
             stats.record(bestClass, pointSet.labels[i]);
         }
 
-        bool update = true;
+        bool update = isEvaluated;
         const bool hasLabels = pointSet.hasLabels();
 
         // if unclassifiedOnly, do not update points with an existing classification
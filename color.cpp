@@ -1,4 +1,3 @@
-#include <array>
 #include "color.hpp"
 
 std::array<float, 3> rgb2hsv(double r, double g, double b) {
@@ -24,3 +23,35 @@ std::array<float, 3> rgb2hsv(double r, double g, double b) {
 
     return { static_cast<float>(hue), static_cast<float>(saturation), static_cast<float>(value) };
 }
+
+void rgb2hsv(const std::array<uint8_t, 3> *colors, const size_t count, std::array<float, 3> *hsv) {
+    // Branch free so that it vectorizes. Each component is a single float division
+    // of exact integers, which rounds the same as the double precision version
+    #pragma omp parallel for simd
+    for (long long int i = 0; i < count; i++) {
+        const int r = colors[i][0];
+        const int g = colors[i][1];
+        const int b = colors[i][2];
+        const int gbMax = g > b ? g : b;
+        const int gbMin = g < b ? g : b;
+        const int colorMax = r > gbMax ? r : gbMax;
+        const int colorMin = r < gbMin ? r : gbMin;
+        const int diff = colorMax - colorMin;
+
+        // Hue sector, with the same precedence as the scalar version (r, g, b)
+        const bool isR = colorMax == r;
+        const bool isG = colorMax == g;
+        int d = r - g;
+        int offset = 240;
+        d = isG ? b - r : d;
+        offset = isG ? 120 : offset;
+        d = isR ? g - b : d;
+        const int wrap = d < 0 ? 360 : 0;
+        offset = isR ? wrap : offset;
+
+        // d and offset are 0 when diff is 0
+        hsv[i][0] = static_cast<float>(60 * d + offset * diff) / static_cast<float>(diff > 0 ? diff : 1);
+        hsv[i][1] = static_cast<float>(100 * diff) / static_cast<float>(colorMax > 0 ? colorMax : 1);
+        hsv[i][2] = static_cast<float>(100 * colorMax) / 255.f;
+    }
+}
@@ -1,10 +1,15 @@
 #ifndef COLOR_H
 #define COLOR_H
 
+#include <array>
+#include <cstddef>
 #include <cstdint>
 
 std::array<float, 3> rgb2hsv(double r, double g, double b);
 
+// Converts count colors at once, with results identical to the scalar version
+void rgb2hsv(const std::array<uint8_t, 3> *colors, size_t count, std::array<float, 3> *hsv);
+
 struct Color {
     uint8_t r, g, b;
     Color() : r(255), g(255), b(255) {};
@@ -5,6 +5,10 @@
 #define N_TREES 50
 #define MAX_DEPTH 30
 #define RADIUS 0.6
+#define BIN_SAMPLES 200000
+#define EARLY_STOP 20
+#define EVAL_FREQ 5
+#define SMOOTH_HOPS 3
 
 #define __MKSTR(s) #s
 #define MKSTR(s) __MKSTR(s)
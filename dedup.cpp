@@ -0,0 +1,165 @@
+#include <algorithm>
+#include <cstring>
+#include <omp.h>
+
+#include "dedup.hpp"
+
+struct DupKey {
+    int64_t x, y, z;
+    uint8_t label;
+    size_t idx;
+
+    inline bool sameCell(const DupKey &o) const {
+        return x == o.x && y == o.y && z == o.z && label == o.label;
+    }
+
+    inline bool operator<(const DupKey &o) const {
+        if (x != o.x) return x < o.x;
+        if (y != o.y) return y < o.y;
+        if (z != o.z) return z < o.z;
+        if (label != o.label) return label < o.label;
+        return idx < o.idx;
+    }
+};
+
+static inline int64_t quantize(const float v, const double tolerance) {
+    if (tolerance > 0) return static_cast<int64_t>(std::floor(v / tolerance));
+
+    int32_t bits;
+    std::memcpy(&bits, &v, sizeof(bits));
+    return bits;
+}
+
+// Sorts one chunk per thread, then merges the chunks pairwise
+static void parallelSort(std::vector<DupKey> &keys) {
+    const size_t n = keys.size();
+    const size_t numChunks = std::max<size_t>(1, std::min<size_t>(omp_get_max_threads(), n / DEDUP_MIN_CHUNK));
+    std::vector<size_t> bounds(numChunks + 1);
+    for (size_t c = 0; c <= numChunks; c++) bounds[c] = n * c / numChunks;
+
+    #pragma omp parallel for schedule(static, 1)
+    for (long long int c = 0; c < static_cast<long long int>(numChunks); c++) {
+        std::sort(keys.begin() + bounds[c], keys.begin() + bounds[c + 1]);
+    }
+
+    for (size_t width = 1; width < numChunks; width *= 2) {
+        const long long int numMerges = static_cast<long long int>((numChunks + 2 * width - 1) / (2 * width));
+
+        #pragma omp parallel for schedule(static, 1)
+        for (long long int m = 0; m < numMerges; m++) {
+            const size_t begin = m * 2 * width;
+            const size_t mid = std::min(begin + width, numChunks);
+            const size_t end = std::min(begin + 2 * width, numChunks);
+            if (mid < end) std::inplace_merge(keys.begin() + bounds[begin], keys.begin() + bounds[mid], keys.begin() + bounds[end]);
+        }
+    }
+}
+
+PointSet *collapseDuplicates(const PointSet &pSet, const double tolerance, std::vector<size_t> &dupMap) {
+    const size_t n = pSet.count();
+    std::vector<DupKey> keys(n);
+
+    #pragma omp parallel for
+    for (long long int i = 0; i < n; i++) {
+        const auto &p = pSet.points[i];
+        keys[i] = { quantize(p[0], tolerance), quantize(p[1], tolerance), quantize(p[2], tolerance),
+            pSet.hasLabels() ? pSet.labels[i] : static_cast<uint8_t>(0), static_cast<size_t>(i) };
+    }
+
+    parallelSort(keys);
+
+    // The first point (lowest index) of each cell represents it. Threads scan
+    // contiguous ranges of keys, moved forward to the start of a cell
+    std::vector<size_t> rep(n);
+
+    #pragma omp parallel
+    {
+        const size_t t = omp_get_thread_num();
+        const size_t numThreads = omp_get_num_threads();
+        size_t begin = n * t / numThreads;
+        size_t end = n * (t + 1) / numThreads;
+        while (begin > 0 && begin < n && keys[begin].sameCell(keys[begin - 1])) begin++;
+        while (end > 0 && end < n && keys[end].sameCell(keys[end - 1])) end++;
+
+        size_t cellStart = begin;
+        for (size_t k = begin; k < end; k++) {
+            if (!keys[k].sameCell(keys[cellStart])) cellStart = k;
+            rep[keys[k].idx] = keys[cellStart].idx;
+        }
+    }
+
+    // Unique points keep the input order
+    std::vector<size_t> uniqueIdx(n, 0);
+    std::vector<size_t> offsets(omp_get_max_threads() + 1, 0);
+    size_t count = 0;
+
+    #pragma omp parallel
+    {
+        const size_t t = omp_get_thread_num();
+        const size_t numThreads = omp_get_num_threads();
+        const size_t begin = n * t / numThreads;
+        const size_t end = n * (t + 1) / numThreads;
+
+        for (size_t i = begin; i < end; i++) {
+            if (rep[i] == i) offsets[t + 1]++;
+        }
+
+        #pragma omp barrier
+        #pragma omp single
+        {
+            for (size_t k = 1; k <= numThreads; k++) offsets[k] += offsets[k - 1];
+            count = offsets[numThreads];
+        }
+
+        size_t next = offsets[t];
+        for (size_t i = begin; i < end; i++) {
+            if (rep[i] == i) uniqueIdx[i] = next++;
+        }
+    }
+
+    dupMap.resize(n);
+    auto *u = new PointSet();
+    u->points.resize(count);
+    u->colors.resize(count);
+    if (pSet.hasLabels()) u->labels.resize(count);
+
+    #pragma omp parallel for
+    for (long long int i = 0; i < n; i++) {
+        dupMap[i] = uniqueIdx[rep[i]];
+        if (rep[i] != i) continue;
+
+        const size_t j = uniqueIdx[i];
+        u->points[j] = pSet.points[i];
+        u->colors[j] = pSet.colors[i];
+        if (pSet.hasLabels()) u->labels[j] = pSet.labels[i];
+    }
+
+    std::cout << "Collapsed " << (n - count) << " duplicate points (" << count << " unique, tolerance: " << tolerance << ")" << std::endl;
+
+    return u;
+}
+
+void expandDuplicates(PointSet &pSet, const PointSet &unique, const std::vector<size_t> &dupMap, const bool useColors) {
+    const size_t numProbabilities = unique.probabilityLabels.size();
+
+    if (unique.hasLabels()) pSet.labels.resize(pSet.count());
+    if (useColors) pSet.colorsModified = true;
+    if (unique.hasConfidence()) pSet.confidence.resize(pSet.count());
+    if (unique.hasProbabilities()) {
+        pSet.probabilities.resize(pSet.count() * numProbabilities);
+        pSet.probabilityLabels = unique.probabilityLabels;
+    }
+
+    #pragma omp parallel for
+    for (long long int i = 0; i < pSet.count(); i++) {
+        const size_t idx = dupMap[i];
+
+        if (unique.hasLabels()) pSet.labels[i] = unique.labels[idx];
+        if (useColors) pSet.colors[i] = unique.colors[idx];
+        if (unique.hasConfidence()) pSet.confidence[i] = unique.confidence[idx];
+        if (unique.hasProbabilities()) {
+            std::copy_n(&unique.probabilities[idx * numProbabilities], numProbabilities,
+                &pSet.probabilities[i * numProbabilities]);
+        }
+    }
+}
@@ -0,0 +1,17 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <vector>
+#include "point_io.hpp"
+
+// Minimum number of points sorted by each thread when looking for duplicates
+#define DEDUP_MIN_CHUNK 4096
+
+// Collapses points with the same label that fall in the same cell of size tolerance
+// (0 = bit-identical coordinates only). dupMap[i] is the index of point i in the returned set
+PointSet *collapseDuplicates(const PointSet &pSet, double tolerance, std::vector<size_t> &dupMap);
+
+// Copies the results of the unique points back to all of their duplicates
+void expandDuplicates(PointSet &pSet, const PointSet &unique, const std::vector<size_t> &dupMap, bool useColors);
+
+#endif
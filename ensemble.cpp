@@ -0,0 +1,81 @@
+#include "ensemble.hpp"
+
+FusionRule parseFusionRule(const std::string &rule) {
+    if (rule == "mean") return MeanFusion;
+    if (rule == "priority") return PriorityFusion;
+    throw std::runtime_error("Invalid fusion rule: " + rule);
+}
+
+Ensemble::Ensemble(const std::vector<Model *> &models, const FusionRule rule, const std::vector<int> &priority) :
+    models(models), rule(rule) {
+    if (models.empty()) throw std::runtime_error("No models");
+
+    for (size_t i = 1; i < models.size(); i++) {
+        if (!models[0]->compatible(*models[i])) {
+            throw std::runtime_error(models[i]->filename + " has different scale parameters than " + models[0]->filename);
+        }
+    }
+
+    numClasses = models[0]->numClasses;
+
+    auto asprsToTrain = getAsprs2TrainCodes();
+    for (const int c : priority) {
+        if (asprsToTrain[c] == LABEL_UNASSIGNED) throw std::runtime_error("Invalid priority class: " + std::to_string(c));
+        classPriority.push_back(asprsToTrain[c]);
+    }
+}
+
+void Ensemble::evaluate(const float *ft, float *probs) const {
+    thread_local std::vector<float> modelProbs;
+    modelProbs.resize(numClasses);
+
+    if (rule == MeanFusion) {
+        std::fill_n(probs, numClasses, 0.f);
+
+        for (const auto *m : models) {
+            m->evaluate(ft, modelProbs.data());
+            for (size_t j = 0; j < numClasses; j++) probs[j] += modelProbs[j];
+        }
+
+        const float scale = 1.f / models.size();
+        for (size_t j = 0; j < numClasses; j++) probs[j] *= scale;
+    }
+    else if (rule == PriorityFusion) {
+        // The model predicting the highest priority class wins,
+        // otherwise the first model does
+        size_t bestRank = classPriority.size();
+
+        for (size_t i = 0; i < models.size(); i++) {
+            float *dst = i == 0 ? probs : modelProbs.data();
+            models[i]->evaluate(ft, dst);
+
+            const size_t bestClass = std::max_element(dst, dst + numClasses) - dst;
+            const size_t rank = std::find(classPriority.begin(), classPriority.end(), static_cast<int>(bestClass)) - classPriority.begin();
+            if (rank < bestRank) {
+                bestRank = rank;
+                if (i > 0) std::copy(modelProbs.begin(), modelProbs.end(), probs);
+            }
+        }
+    }
+}
+
+void Ensemble::classify(PointSet &pointSet,
+    const std::vector<Feature *> &features,
+    const std::vector<Label> &labels,
+    const Regularization regularization,
+    const double regRadius,
+    const bool useColors,
+    const bool unclassifiedOnly,
+    const bool evaluate,
+    const std::vector<int> &skip,
+    const std::string &statsFile,
+    const bool confidence,
+    const bool probabilities,
+    const int smoothHops) const {
+    classifyData<float>(pointSet,
+        [this](const float *ft, float *probs) {
+            this->evaluate(ft, probs);
+        },
+        features, labels, regularization, regRadius, useColors, unclassifiedOnly, evaluate, skip, statsFile,
+        confidence, probabilities, smoothHops);
+}
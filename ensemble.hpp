@@ -0,0 +1,36 @@
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+
+#include "model.hpp"
+
+enum FusionRule { MeanFusion, PriorityFusion };
+FusionRule parseFusionRule(const std::string &rule);
+
+// Several models sharing the same features, whose
+// outputs are merged into a single probability vector
+class Ensemble {
+    std::vector<Model *> models;
+    FusionRule rule;
+    std::vector<int> classPriority; // training codes, highest priority first
+    size_t numClasses;
+public:
+    Ensemble(const std::vector<Model *> &models, FusionRule rule, const std::vector<int> &priority);
+
+    void evaluate(const float *ft, float *probs) const;
+
+    void classify(PointSet &pointSet,
+        const std::vector<Feature *> &features,
+        const std::vector<Label> &labels,
+        Regularization regularization = Regularization::None,
+        double regRadius = 2.5,
+        bool useColors = false,
+        bool unclassifiedOnly = false,
+        bool evaluate = false,
+        const std::vector<int> &skip = {},
+        const std::string &statsFile = "",
+        bool confidence = false,
+        bool probabilities = false,
+        int smoothHops = SMOOTH_HOPS) const;
+};
+
+#endif
@@ -0,0 +1,153 @@
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
+
+#include "evaluate.hpp"
+#include "statistics.hpp"
+
+namespace fs = std::filesystem;
+
+json evaluateModels(PointSet &pointSet, const std::vector<Model *> &models, const ScaleOptions &options) {
+    if (!pointSet.hasLabels()) throw std::runtime_error("Evaluation requires a labeled point cloud");
+    if (models.empty()) throw std::runtime_error("No models to evaluate");
+
+    const auto labels = getTrainingLabels();
+    const size_t numLabels = labels.size();
+
+    json groups = json::array();
+    std::vector<json> results(models.size());
+    std::vector<Statistics *> stats(models.size(), nullptr);
+    std::vector<double> pointsPerSecond(models.size(), 0.0);
+    std::vector<bool> done(models.size(), false);
+
+    for (size_t g = 0; g < models.size(); g++) {
+        if (done[g]) continue;
+
+        // Models sharing scale parameters share features
+        const Model *ref = models[g];
+        std::vector<size_t> group;
+        for (size_t m = g; m < models.size(); m++) {
+            if (!done[m] && ref->compatible(*models[m])) {
+                group.push_back(m);
+                done[m] = true;
+            }
+        }
+
+        std::cout << "Computing features for " << group.size() << " model(s) (resolution: " << ref->resolution
+            << ", radius: " << ref->radius << ", scales: " << ref->numScales << ")" << std::endl;
+        auto start = std::chrono::steady_clock::now();
+
+        ScaleOptions scaleOptions = options;
+        scaleOptions.momentScales = ref->momentScales;
+        const auto scales = computeScales(ref->numScales, &pointSet, ref->resolution, ref->radius, scaleOptions);
+        const auto features = getFeatures(scales);
+        PointSet *base = pointSet.base;
+
+        // Gather the features once so that only inference is timed
+        const size_t numFeatures = features.size();
+        const size_t evalCount = base->evalCount();
+        std::vector<float> ft(evalCount * numFeatures);
+
+        #pragma omp parallel for
+        for (long long int k = 0; k < evalCount; k++) {
+            const size_t idx = base->evalPoint(k);
+            for (std::size_t f = 0; f < numFeatures; f++) {
+                ft[k * numFeatures + f] = features[f]->getValue(idx);
+            }
+        }
+
+        const double featureTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        json modelFiles = json::array();
+        for (const size_t m : group) modelFiles.push_back(models[m]->filename);
+        groups.push_back({
+            {"resolution", ref->resolution},
+            {"radius", ref->radius},
+            {"scales", ref->numScales},
+            {"features", numFeatures},
+            {"feature_seconds", featureTime},
+            {"models", modelFiles}
+        });
+
+        // Base points outside of the evaluated subset have no label
+        std::vector<uint8_t> evaluated;
+        if (base->evalSubset) {
+            evaluated.resize(base->count(), 0);
+            for (const size_t idx : base->evalIdx) evaluated[idx] = 1;
+        }
+
+        std::vector<uint8_t> predicted(base->count(), 0);
+
+        // Models are scored one after another (each with all threads), so
+        // that their throughputs do not depend on each other
+        for (const size_t m : group) {
+            const Model *model = models[m];
+            if (model->numFeatures > numFeatures) throw std::runtime_error(model->filename + " expects more features than were computed");
+
+            std::cout << "Evaluating " << model->filename << "..." << std::endl;
+            start = std::chrono::steady_clock::now();
+
+            #pragma omp parallel
+            {
+                std::vector<float> probs(numLabels, 0.f);
+
+                #pragma omp for
+                for (long long int k = 0; k < evalCount; k++) {
+                    model->evaluate(&ft[k * numFeatures], probs.data());
+                    predicted[base->evalPoint(k)] = std::max_element(probs.begin(), probs.end()) - probs.begin();
+                }
+            }
+
+            const double inferenceTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            stats[m] = new Statistics(labels);
+            Statistics &s = *stats[m];
+
+            #pragma omp parallel for
+            for (long long int i = 0; i < pointSet.count(); i++) {
+                const size_t idx = pointSet.pointMap[i];
+                if (!evaluated.empty() && !evaluated[idx]) continue;
+                if (pointSet.labels[i] >= numLabels) continue;
+                s.record(predicted[idx], pointSet.labels[i]);
+            }
+            s.finalize();
+
+            pointsPerSecond[m] = evalCount / std::max(inferenceTime, 1e-9);
+            json &r = results[m];
+            r = s.toJson();
+            r["model"] = model->filename;
+            r["type"] = model->type == RandomForest ? "rf" : "gbt";
+            r["size_bytes"] = fs::file_size(model->filename);
+            r["inference_seconds"] = inferenceTime;
+            r["points_per_second"] = pointsPerSecond[m];
+            r["feature_seconds"] = featureTime;
+        }
+
+        for (size_t i = 0; i < scales.size(); i++) delete scales[i];
+        for (size_t i = 0; i < features.size(); i++) delete features[i];
+        pointSet.base = nullptr;
+    }
+
+    for (size_t m = 0; m < models.size(); m++) {
+        std::cout << "Model: " << models[m]->filename << std::endl;
+        stats[m]->print();
+    }
+
+    std::cout << "  " << std::setw(32) << "Model" << " | " << std::setw(10) << "Accuracy" << " | " << std::setw(10) << "Avg F1" << " | " << std::setw(12) << "Points/s" << " | " << std::setw(10) << "Size (MB)" << " | " << std::endl;
+    std::cout << "  " << std::string(32, '-') << " | " << std::string(10, '-') << " | " << std::string(10, '-') << " | " << std::string(12, '-') << " | " << std::string(10, '-') << " | " << std::endl;
+    for (size_t m = 0; m < models.size(); m++) {
+        const std::string name = fs::path(models[m]->filename).filename().string();
+        std::cout << "  " << std::setw(32) << name.substr(0, 32) << " | ";
+        std::cout << std::setw(9) << std::fixed << std::setprecision(2) << stats[m]->getAccuracy() * 100 << "% | ";
+        std::cout << std::setw(10) << std::fixed << std::setprecision(2) << stats[m]->getAvgF1() << " | ";
+        std::cout << std::setw(12) << std::fixed << std::setprecision(0) << pointsPerSecond[m] << " | ";
+        std::cout << std::setw(10) << std::fixed << std::setprecision(2) << results[m]["size_bytes"].get<double>() / (1024.0 * 1024.0) << " | " << std::endl;
+        delete stats[m];
+    }
+    std::cout << std::endl;
+
+    return json{
+        {"points", pointSet.count()},
+        {"feature_groups", groups},
+        {"models", results}
+    };
+}
@@ -0,0 +1,12 @@
+#ifndef EVALUATE_H
+#define EVALUATE_H
+
+#include "model.hpp"
+#include "scale.hpp"
+
+// Scores models on a labeled point cloud (without regularization), computing
+// features only once for each distinct scale configuration. Returns a report
+// with accuracy, per-class metrics, confusion matrix, throughput and size of each model
+json evaluateModels(PointSet &pointSet, const std::vector<Model *> &models, const ScaleOptions &options = ScaleOptions());
+
+#endif
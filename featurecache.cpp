@@ -0,0 +1,248 @@
+#include <cstring>
+#include <filesystem>
+#include <sstream>
+#include <iomanip>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "featurecache.hpp"
+
+namespace fs = std::filesystem;
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t evalSubset;
+    uint64_t key;
+    uint64_t numBase;
+    uint64_t numInput;
+    uint64_t numEval;
+    uint64_t numFeatures;
+    uint64_t hasGraph;
+    uint64_t numGraph;
+    uint64_t namesSize;
+};
+
+static const char CACHE_MAGIC[8] = { 'O', 'P', 'C', 'F', 'E', 'A', 'T', 'S' };
+
+static inline uint64_t fnv1a(const void *data, const size_t size, uint64_t h = FNV_OFFSET) {
+    const auto *bytes = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < size; i++) {
+        h ^= bytes[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+// Hashes 1MB blocks in parallel, then hashes the block hashes
+static uint64_t fnv1aBlocks(const void *data, const size_t size, const uint64_t seed) {
+    const size_t blockSize = 1024 * 1024;
+    const size_t numBlocks = (size + blockSize - 1) / blockSize;
+    std::vector<uint64_t> hashes(numBlocks);
+    const auto *bytes = static_cast<const uint8_t *>(data);
+
+    #pragma omp parallel for
+    for (long long int b = 0; b < numBlocks; b++) {
+        const size_t start = b * blockSize;
+        hashes[b] = fnv1a(bytes + start, std::min(blockSize, size - start));
+    }
+
+    return fnv1a(hashes.data(), hashes.size() * sizeof(uint64_t), fnv1a(&size, sizeof(size), seed));
+}
+
+static inline size_t align8(const size_t offset) {
+    return (offset + 7) & ~static_cast<size_t>(7);
+}
+
+static std::string cacheFilename(const std::string &cacheDir, const uint64_t key) {
+    std::stringstream ss;
+    ss << std::hex << std::setw(16) << std::setfill('0') << key << ".opcf";
+    return (fs::path(cacheDir) / ss.str()).string();
+}
+
+MappedFile::MappedFile(const std::string &filename) {
+    #ifdef _WIN32
+    std::ifstream f(filename, std::ios::binary | std::ios::ate);
+    if (!f.is_open()) throw std::runtime_error("Cannot open " + filename);
+    size = f.tellg();
+    f.seekg(0);
+    buffer.resize(size);
+    f.read(buffer.data(), size);
+    data = buffer.data();
+    #else
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) throw std::runtime_error("Cannot open " + filename);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        throw std::runtime_error("Cannot stat " + filename);
+    }
+    size = st.st_size;
+
+    void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) throw std::runtime_error("Cannot map " + filename);
+    data = static_cast<const char *>(addr);
+    #endif
+}
+
+MappedFile::~MappedFile() {
+    #ifndef _WIN32
+    if (data != nullptr) munmap(const_cast<char *>(data), size);
+    #endif
+}
+
+uint64_t featureCacheKey(const PointSet &pSet, const double startResolution, const double radius, const int numScales, const ScaleOptions &options) {
+    uint64_t h = FNV_OFFSET;
+    const uint32_t version = FEATURE_CACHE_VERSION;
+    h = fnv1a(&version, sizeof(version), h);
+    h = fnv1a(&startResolution, sizeof(startResolution), h);
+    h = fnv1a(&radius, sizeof(radius), h);
+    h = fnv1a(&numScales, sizeof(numScales), h);
+    h = fnv1a(&options.previewScale, sizeof(options.previewScale), h);
+    h = fnv1a(&options.updateHalo, sizeof(options.updateHalo), h);
+    h = fnv1a(&options.quantum, sizeof(options.quantum), h);
+    h = fnv1a(&options.momentScales, sizeof(options.momentScales), h);
+    const uint8_t knnGraph = options.knnGraph ? 1 : 0;
+    h = fnv1a(&knnGraph, sizeof(knnGraph), h);
+
+    std::vector<uint8_t> mask(options.updateMask.begin(), options.updateMask.end());
+    h = fnv1aBlocks(mask.data(), mask.size(), h);
+
+    // Features only depend on the points' coordinates and colors
+    h = fnv1aBlocks(pSet.points.data(), pSet.points.size() * sizeof(pSet.points[0]), h);
+    h = fnv1aBlocks(pSet.colors.data(), pSet.colors.size() * sizeof(pSet.colors[0]), h);
+
+    return h;
+}
+
+std::vector<Feature *> loadCachedFeatures(const std::string &cacheDir, const uint64_t key, PointSet &pSet) {
+    const std::string filename = cacheFilename(cacheDir, key);
+    if (!fs::exists(filename)) return {};
+
+    auto file = std::make_shared<MappedFile>(filename);
+    const char *data = file->getData();
+
+    CacheHeader header;
+    if (file->getSize() < sizeof(header)) throw std::runtime_error("Invalid feature cache " + filename);
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header.version != FEATURE_CACHE_VERSION || header.key != key) {
+        std::cout << "Ignoring stale feature cache " << filename << std::endl;
+        return {};
+    }
+    if (header.numInput != pSet.count()) throw std::runtime_error("Feature cache " + filename + " does not match the input");
+
+    size_t offset = align8(sizeof(header));
+    const auto section = [&](const size_t bytes) {
+        const char *ptr = data + offset;
+        offset = align8(offset + bytes);
+        if (offset > file->getSize() && bytes > 0) throw std::runtime_error("Truncated feature cache " + filename);
+        return ptr;
+    };
+
+    auto *base = new PointSet();
+    base->points.resize(header.numBase);
+    std::memcpy(base->points.data(), section(header.numBase * sizeof(base->points[0])), header.numBase * sizeof(base->points[0]));
+
+    pSet.pointMap.resize(header.numInput);
+    std::memcpy(pSet.pointMap.data(), section(header.numInput * sizeof(size_t)), header.numInput * sizeof(size_t));
+
+    base->evalSubset = header.evalSubset != 0;
+    base->evalIdx.resize(header.numEval);
+    std::memcpy(base->evalIdx.data(), section(header.numEval * sizeof(size_t)), header.numEval * sizeof(size_t));
+
+    if (header.hasGraph) {
+        base->graphOffsets.resize(header.numBase + 1);
+        std::memcpy(base->graphOffsets.data(), section(base->graphOffsets.size() * sizeof(size_t)), base->graphOffsets.size() * sizeof(size_t));
+        base->graphNeighbors.resize(header.numGraph);
+        std::memcpy(base->graphNeighbors.data(), section(header.numGraph * sizeof(uint32_t)), header.numGraph * sizeof(uint32_t));
+    }
+
+    std::stringstream names(std::string(section(header.namesSize), header.namesSize));
+
+    std::vector<Feature *> features;
+    std::string name;
+    for (size_t f = 0; f < header.numFeatures; f++) {
+        std::getline(names, name);
+        const auto *values = reinterpret_cast<const float *>(section(header.numBase * sizeof(float)));
+        features.push_back(new CachedFeature(name, file, values));
+    }
+
+    pSet.base = base;
+    std::cout << "Loaded " << features.size() << " features from " << filename << std::endl;
+
+    return features;
+}
+
+void saveCachedFeatures(const std::string &cacheDir, const uint64_t key, const PointSet &pSet, const std::vector<Feature *> &features) {
+    const PointSet *base = pSet.base;
+    fs::create_directories(cacheDir);
+
+    const std::string filename = cacheFilename(cacheDir, key);
+    const std::string tmpFilename = filename + ".tmp";
+    std::ofstream o(tmpFilename, std::ios::binary | std::ios::trunc);
+    if (!o.is_open()) throw std::runtime_error("Cannot write " + tmpFilename);
+
+    std::string names;
+    for (const auto *f : features) names += f->getName() + "\n";
+
+    CacheHeader header;
+    std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = FEATURE_CACHE_VERSION;
+    header.evalSubset = base->evalSubset ? 1 : 0;
+    header.key = key;
+    header.numBase = base->count();
+    header.numInput = pSet.count();
+    header.numEval = base->evalIdx.size();
+    header.numFeatures = features.size();
+    header.hasGraph = base->hasGraph() ? 1 : 0;
+    header.numGraph = base->graphNeighbors.size();
+    header.namesSize = names.size();
+
+    size_t offset = 0;
+    const auto write = [&](const void *ptr, const size_t bytes) {
+        o.write(static_cast<const char *>(ptr), bytes);
+        const char zeros[8] = { 0 };
+        o.write(zeros, align8(offset + bytes) - (offset + bytes));
+        offset = align8(offset + bytes);
+    };
+
+    write(&header, sizeof(header));
+    write(base->points.data(), base->count() * sizeof(base->points[0]));
+    write(pSet.pointMap.data(), pSet.count() * sizeof(size_t));
+    write(base->evalIdx.data(), base->evalIdx.size() * sizeof(size_t));
+    if (base->hasGraph()) {
+        write(base->graphOffsets.data(), base->graphOffsets.size() * sizeof(size_t));
+        write(base->graphNeighbors.data(), base->graphNeighbors.size() * sizeof(uint32_t));
+    }
+    write(names.data(), names.size());
+
+    // One column per feature, points that are not evaluated are left at 0
+    std::vector<float> column(base->count());
+    for (auto *f : features) {
+        std::fill(column.begin(), column.end(), 0.f);
+
+        #pragma omp parallel for
+        for (long long int k = 0; k < base->evalCount(); k++) {
+            const size_t idx = base->evalPoint(k);
+            column[idx] = f->getValue(idx);
+        }
+
+        write(column.data(), column.size() * sizeof(float));
+    }
+
+    o.close();
+    if (!o) throw std::runtime_error("Cannot write " + tmpFilename);
+    fs::rename(tmpFilename, filename);
+
+    std::cout << "Saved features to " << filename << std::endl;
+}
@@ -0,0 +1,46 @@
+#ifndef FEATURECACHE_H
+#define FEATURECACHE_H
+
+#include <memory>
+#include "features.hpp"
+
+// Bump when the layout or the feature definitions change
+#define FEATURE_CACHE_VERSION 2
+
+// Read-only memory mapping of a file
+class MappedFile {
+    const char *data = nullptr;
+    size_t size = 0;
+    #ifdef _WIN32
+    std::vector<char> buffer;
+    #endif
+public:
+    explicit MappedFile(const std::string &filename);
+    ~MappedFile();
+
+    const char *getData() const { return data; }
+    size_t getSize() const { return size; }
+};
+
+// A feature column stored in a cache file
+class CachedFeature : public Feature {
+    std::shared_ptr<MappedFile> file;
+    const float *values;
+public:
+    CachedFeature(const std::string &name, std::shared_ptr<MappedFile> file, const float *values) :
+        Feature(nullptr), file(file), values(values) {
+        this->name = name;
+    }
+    virtual float getValue(std::size_t i) {
+        return values[i];
+    }
+};
+
+// Identifies the features of pSet computed with the given scale parameters
+uint64_t featureCacheKey(const PointSet &pSet, double startResolution, double radius, int numScales, const ScaleOptions &options);
+
+// Restores pSet's base point set and returns its features, or an empty vector if nothing is cached under key
+std::vector<Feature *> loadCachedFeatures(const std::string &cacheDir, uint64_t key, PointSet &pSet);
+void saveCachedFeatures(const std::string &cacheDir, uint64_t key, const PointSet &pSet, const std::vector<Feature *> &features);
+
+#endif
@@ -173,11 +173,8 @@ public:
     };
 
     virtual float getValue(size_t i) {
-        double r = s->pSet->colors[i][0];
-        double g = s->pSet->colors[i][1];
-        double b = s->pSet->colors[i][2];
-        auto hsv = rgb2hsv(r, g, b);
-        return hsv[componentIdx];
+        // The first scale's pSet is its scaledSet
+        return s->hsv[i][componentIdx];
     }
 };
 
@@ -1,12 +1,32 @@
 #include <iostream>
 #include <random>
 #include <algorithm>
+#include <numeric>
+#include <iterator>
 
 #include "classifier.hpp"
 #include "gbm.hpp"
 
 namespace gbm {
 
+static void pushRows(LightGBM::Dataset *dset, const std::vector<float> &ft, const size_t numFeats) {
+    const size_t numRows = ft.size() / numFeats;
+
+    #pragma omp parallel
+    {
+        std::vector<double> row(numFeats);
+
+        #pragma omp for schedule(static)
+        for (long long int i = 0; i < static_cast<long long int>(numRows); ++i) {
+            const float *src = &ft[i * numFeats];
+            std::copy(src, src + numFeats, row.begin());
+            dset->PushOneRow(omp_get_thread_num(), i, row);
+        }
+    }
+
+    dset->FinishLoad();
+}
+
 Boosting *train(const std::vector<std::string> &filenames,
     double *startResolution,
     const int numScales,
@@ -14,32 +34,28 @@ Boosting *train(const std::vector<std::string> &filenames,
     const int treeDepth,
     const double radius,
     const int maxSamples,
-    const std::vector<int> &classes) {
+    const std::vector<int> &classes,
+    const int binSamples,
+    const std::string &validFilename,
+    const int earlyStop,
+    const int evalFreq,
+    const unsigned int momentScales) {
 
     std::vector<float> gt;
-    std::vector< std::vector<double> > featureRows;
-    std::vector< std::vector<double> > featuresData;
-    std::vector< std::vector<int> > featuresIdx;
+    std::vector<float> ft;
     size_t numFeats;
     int numClass;
 
-    getTrainingData(filenames, startResolution, numScales, radius, maxSamples, classes,
-        [&featureRows, &featuresData, &featuresIdx, &gt](const std::vector<Feature *> &features, const size_t idx, const int g) {
-            const size_t row = featureRows.size();
-            featureRows.emplace_back();
-            featureRows[row].resize(features.size(), 0);
+    getTrainingData(filenames, startResolution, numScales, radius, maxSamples, classes, momentScales,
+        [&ft, &gt](const std::vector<Feature *> &features, const size_t idx, const int g) {
             for (std::size_t f = 0; f < features.size(); f++) {
-                featureRows[row][f] = features[f]->getValue(idx);
-                featuresData[f].push_back(featureRows[row][f]);
-                featuresIdx[f].push_back(row);
+                ft.push_back(features[f]->getValue(idx));
             }
             gt.push_back(g);
         },
-        [&numFeats, &numClass, &featuresData, &featuresIdx](const size_t numFeatures, const int numClasses) {
+        [&numFeats, &numClass](const size_t numFeatures, const int numClasses) {
             numFeats = numFeatures;
             numClass = numClasses;
-            featuresData.resize(numFeats);
-            featuresIdx.resize(numFeats);
         });
 
     const size_t numRows = gt.size();
@@ -48,23 +64,47 @@ Boosting *train(const std::vector<std::string> &filenames,
     LightGBM::Config ioconfig;
     ioconfig.num_class = numClass;
     ioconfig.max_bin = 255;
+    ioconfig.bin_construct_sample_cnt = binSamples;
+
+    // Bin mappers only need a random subset of the rows to find
+    // good bin boundaries (same approach as LightGBM's C API)
+    const size_t sampleCnt = std::min<size_t>(numRows, std::max(binSamples, 1));
+    std::vector<size_t> sampleIdx;
+    sampleIdx.reserve(sampleCnt);
+    {
+        std::vector<size_t> rows(numRows);
+        std::iota(rows.begin(), rows.end(), 0);
+        std::mt19937 ranGen(ioconfig.data_random_seed);
+        std::sample(rows.begin(), rows.end(), std::back_inserter(sampleIdx), sampleCnt, ranGen);
+    }
+
+    std::vector< std::vector<double> > sampleValues(numFeats);
+    std::vector< std::vector<int> > sampleRows(numFeats);
+    for (size_t i = 0; i < sampleIdx.size(); i++) {
+        const float *row = &ft[sampleIdx[i] * numFeats];
+        for (size_t f = 0; f < numFeats; f++) {
+            if (std::fabs(row[f]) > LightGBM::kZeroThreshold || std::isnan(row[f])) {
+                sampleValues[f].push_back(row[f]);
+                sampleRows[f].push_back(static_cast<int>(i));
+            }
+        }
+    }
+
+    std::cout << "Constructing bins from " << sampleCnt << " samples" << std::endl;
 
     std::unique_ptr<LightGBM::Dataset> dset;
     LightGBM::DatasetLoader loader(ioconfig, nullptr, numClass, nullptr);
-    dset.reset(loader.ConstructFromSampleData(LightGBM::Common::Vector2Ptr<double>(&featuresData).data(),
-        LightGBM::Common::Vector2Ptr<int>(&featuresIdx).data(),
+    dset.reset(loader.ConstructFromSampleData(LightGBM::Common::Vector2Ptr<double>(&sampleValues).data(),
+        LightGBM::Common::Vector2Ptr<int>(&sampleRows).data(),
         numFeats,
-        LightGBM::Common::VectorSize<double>(featuresData).data(),
-        numRows,
+        LightGBM::Common::VectorSize<double>(sampleValues).data(),
+        sampleCnt,
         numRows,
         numRows));
 
-    #pragma omp parallel for schedule(static)
-    for (long long int i = 0; i < numRows; ++i) {
-        dset->PushOneRow(omp_get_thread_num(), i, featureRows[i]);
-    }
-
-    dset->FinishLoad();
+    pushRows(dset.get(), ft, numFeats);
+    ft.clear();
+    ft.shrink_to_fit();
 
     /*
         for(int j = 0; j < numFeats; j++){
@@ -81,6 +121,37 @@ Boosting *train(const std::vector<std::string> &filenames,
         throw std::runtime_error("Error setting label");
     }
 
+    // Validation data shares the bin mappers of the training set
+    std::unique_ptr<LightGBM::Dataset> validDset;
+    if (!validFilename.empty()) {
+        std::cout << "Reading validation data from " << validFilename << std::endl;
+
+        std::vector<float> vgt;
+        std::vector<float> vft;
+        getTrainingData({ validFilename }, startResolution, numScales, radius, maxSamples, classes, momentScales,
+            [&vft, &vgt](const std::vector<Feature *> &features, const size_t idx, const int g) {
+                for (std::size_t f = 0; f < features.size(); f++) {
+                    vft.push_back(features[f]->getValue(idx));
+                }
+                vgt.push_back(g);
+            },
+            [&numFeats, &numClass](const size_t numFeatures, const int numClasses) {
+                if (numFeatures != numFeats) throw std::runtime_error("Validation features do not match training features");
+                if (numClasses != numClass) throw std::runtime_error("Validation classes do not match training classes");
+            });
+
+        if (vgt.empty()) throw std::runtime_error("Validation dataset has no usable labels");
+        std::cout << "Using " << vgt.size() << " validation samples" << std::endl;
+
+        validDset.reset(new LightGBM::Dataset(vgt.size()));
+        validDset->CreateValid(dset.get());
+        pushRows(validDset.get(), vft, numFeats);
+
+        if (!validDset->SetFloatField("label", vgt.data(), vgt.size())) {
+            throw std::runtime_error("Error setting validation label");
+        }
+    }
+
     LightGBM::Config boostConfig;
     boostConfig.num_iterations = numTrees;
     // boostConfig.bagging_freq = 1;
@@ -93,7 +164,7 @@ Boosting *train(const std::vector<std::string> &filenames,
     boostConfig.learning_rate = 0.2;
 
     std::stringstream ss;
-    ss << *startResolution << " " << radius << " " << numScales;
+    ss << *startResolution << " " << radius << " " << numScales << " " << momentScales;
     boostConfig.data = ss.str();
 
     LightGBM::Config objConfig;
@@ -115,24 +186,57 @@ Boosting *train(const std::vector<std::string> &filenames,
     booster->Init(&boostConfig, dset.get(), objFunc,
         LightGBM::Common::ConstPtrInVectorWrapper<LightGBM::Metric>(trainMetrics));
 
-    // Add if you want to add validation data (eval)
-    // booster->AddValidDataset(dset.get(), LightGBM::Common::ConstPtrInVectorWrapper<LightGBM::Metric>(trainMetrics));
+    std::vector< std::unique_ptr<LightGBM::Metric> > validMetrics;
+    if (validDset) {
+        auto validMetric = std::unique_ptr<LightGBM::Metric>(
+            LightGBM::Metric::CreateMetric("multi_logloss", metricConfig));
+        validMetric->Init(validDset->metadata(), validDset->num_data());
+        validMetrics.push_back(std::move(validMetric));
+        booster->AddValidDataset(validDset.get(), LightGBM::Common::ConstPtrInVectorWrapper<LightGBM::Metric>(validMetrics));
+    }
 
-    for (int i = 0; i < boostConfig.num_iterations; i++) {
-        auto scores = booster->GetEvalAt(0);
-        for (const auto &v : scores) std::cout << "Iteration " << (i + 1) << " score: " << v << std::endl;
+    // multi_logloss: lower is better
+    double bestScore = std::numeric_limits<double>::max();
+    int bestIter = 0;
 
+    for (int i = 0; i < boostConfig.num_iterations; i++) {
         if (booster->TrainOneIter(nullptr, nullptr)) {
             std::cout << "Breaking.." << std::endl;
             break;
         }
+
+        const int iter = i + 1;
+        if (iter % std::max(evalFreq, 1) != 0 && iter != boostConfig.num_iterations) continue;
+
+        for (const auto &v : booster->GetEvalAt(0)) std::cout << "Iteration " << iter << " score: " << v;
+
+        if (validDset) {
+            const double score = booster->GetEvalAt(1)[0];
+            std::cout << " validation: " << score;
+
+            if (score < bestScore) {
+                bestScore = score;
+                bestIter = iter;
+            }
+            else if (earlyStop > 0 && iter - bestIter >= earlyStop) {
+                std::cout << std::endl << "No improvement for " << (iter - bestIter) << " iterations, stopping" << std::endl;
+                break;
+            }
+        }
+
+        std::cout << std::endl;
+    }
+
+    if (validDset && bestIter > 0) {
+        while (booster->GetCurrentIteration() > bestIter) booster->RollbackOneIter();
+        std::cout << "Best iteration: " << bestIter << " (validation score: " << bestScore << ")" << std::endl;
     }
 
     return booster;
 }
 
 Boosting *loadBooster(const std::string &modelFilename) {
-    std::cout << "Loading " << modelFilename << std::endl;
+    logStream() << "Loading " << modelFilename << std::endl;
 
     auto *booster = LightGBM::Boosting::CreateBoosting("gbdt", nullptr);
     if (!LightGBM::Boosting::LoadFileToBoosting(booster, modelFilename.c_str())) {
@@ -157,6 +261,9 @@ BoosterParams extractBoosterParams(Boosting *booster) {
     ss >> p.resolution;
     ss >> p.radius;
     ss >> p.numScales;
+
+    // Older models do not store moment scales
+    if (!(ss >> p.momentScales)) p.momentScales = 0;
     return p;
 
 }
@@ -171,17 +278,34 @@ void classify(PointSet &pointSet,
     const bool unclassifiedOnly,
     const bool evaluate,
     const std::vector<int> &skip,
-    const std::string &statsFile
+    const std::string &statsFile,
+    const bool confidence,
+    const bool probabilities,
+    const int smoothHops
 ) {
 
     LightGBM::PredictionEarlyStopConfig early_stop_config;
     auto earlyStop = LightGBM::CreatePredictionEarlyStopInstance("none", early_stop_config);
 
-    classifyData<double>(pointSet,
-        [&booster, &earlyStop](const double *ft, double *probs) {
-            booster->Predict(ft, probs, &earlyStop);
+    const size_t numFeatures = features.size();
+    const size_t numClasses = labels.size();
+
+    // Features and probabilities are kept in single precision (which halves
+    // the memory used by smoothing), LightGBM only works with doubles
+    // so we convert at the boundary using per-thread buffers
+    classifyData<float>(pointSet,
+        [&booster, &earlyStop, numFeatures, numClasses](const float *ft, float *probs) {
+            thread_local std::vector<double> dft;
+            thread_local std::vector<double> dprobs;
+            dft.resize(numFeatures);
+            dprobs.resize(numClasses);
+
+            std::copy(ft, ft + numFeatures, dft.begin());
+            booster->Predict(dft.data(), dprobs.data(), &earlyStop);
+            std::copy(dprobs.begin(), dprobs.end(), probs);
         },
-        features, labels, regularization, regRadius, useColors, unclassifiedOnly, evaluate, skip, statsFile);
+        features, labels, regularization, regRadius, useColors, unclassifiedOnly, evaluate, skip, statsFile,
+        confidence, probabilities, smoothHops);
 }
 
 }
@@ -28,13 +28,19 @@ Boosting *train(const std::vector<std::string> &filenames,
     int treeDepth,
     double radius,
     int maxSamples,
-    const std::vector<int> &classes
+    const std::vector<int> &classes,
+    int binSamples = BIN_SAMPLES,
+    const std::string &validFilename = "",
+    int earlyStop = EARLY_STOP,
+    int evalFreq = EVAL_FREQ,
+    unsigned int momentScales = 0
 );
 
 struct BoosterParams {
     double resolution;
     double radius;
     int numScales;
+    unsigned int momentScales;
 };
 
 Boosting *loadBooster(const std::string &modelFilename);
@@ -52,7 +58,10 @@ void classify(PointSet &pointSet,
     bool unclassifiedOnly = false,
     bool evaluate = false,
     const std::vector<int> &skip = {},
-    const std::string &statsFile = "");
+    const std::string &statsFile = "",
+    bool confidence = false,
+    bool probabilities = false,
+    int smoothHops = SMOOTH_HOPS);
 
 }
 
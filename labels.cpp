@@ -1,3 +1,5 @@
+#include <sstream>
+#include <stdexcept>
 #include "labels.hpp"
 
 std::vector<Label> getLabels() {
@@ -83,4 +85,25 @@ std::unordered_map<int, int> getTrain2AsprsCodes() {
     }
 
     return out;
-}
\ No newline at end of file
+}
+
+// Parses ASPRS class groups such as "3+4+5,6"
+// (groups are comma separated, classes within a group joined by +)
+std::vector<std::vector<int> > parseClassGroups(const std::string &groups) {
+    std::vector<std::vector<int> > out;
+    std::istringstream gss(groups);
+    std::string group;
+
+    while (std::getline(gss, group, ',')) {
+        std::vector<int> classes;
+        std::istringstream css(group);
+        std::string c;
+        while (std::getline(css, c, '+')) {
+            if (!c.empty()) classes.push_back(std::stoi(c));
+        }
+        if (!classes.empty()) out.push_back(classes);
+    }
+
+    if (out.empty()) throw std::runtime_error("Invalid class groups: " + groups);
+    return out;
+}
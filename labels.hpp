@@ -30,5 +30,6 @@ std::vector<Label> getTrainingLabels();
 std::unordered_map<std::string, int> getTrainingCodes();
 std::unordered_map<int, int> getAsprs2TrainCodes();
 std::unordered_map<int, int> getTrain2AsprsCodes();
+std::vector<std::vector<int> > parseClassGroups(const std::string &groups);
 
 #endif
\ No newline at end of file
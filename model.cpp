@@ -0,0 +1,98 @@
+#include "model.hpp"
+
+Model *loadModel(const std::string &modelFile) {
+    auto *m = new Model();
+    m->type = fingerprint(modelFile);
+    m->filename = modelFile;
+    m->numClasses = getTrainingLabels().size();
+
+    #ifndef WITH_GBT
+    if (m->type == GradientBoostedTrees) throw std::runtime_error(modelFile + " is a GBT model but GBT support has not been built (try building with -DWITH_GBT=ON)");
+    #endif
+
+    logStream() << "Model: " << (m->type == RandomForest ? "Random Forest" : "Gradient Boosted Trees") << std::endl;
+
+    if (m->type == RandomForest) {
+        m->rtrees = rf::loadForest(modelFile);
+        m->resolution = m->rtrees->params.resolution;
+        m->radius = m->rtrees->params.radius;
+        m->numScales = m->rtrees->params.numScales;
+        m->momentScales = m->rtrees->params.momentScales;
+        m->numFeatures = m->rtrees->params.n_features;
+    }
+    #ifdef WITH_GBT
+    else {
+        m->booster = gbm::loadBooster(modelFile);
+        const gbm::BoosterParams p = gbm::extractBoosterParams(m->booster);
+        m->resolution = p.resolution;
+        m->radius = p.radius;
+        m->numScales = p.numScales;
+        m->momentScales = p.momentScales;
+        m->numFeatures = m->booster->MaxFeatureIdx() + 1;
+
+        LightGBM::PredictionEarlyStopConfig earlyStopConfig;
+        m->earlyStop = LightGBM::CreatePredictionEarlyStopInstance("none", earlyStopConfig);
+    }
+    #endif
+
+    return m;
+}
+
+void Model::evaluate(const float *ft, float *probs) const {
+    if (type == RandomForest) {
+        // Forests only output values up to the highest trained class
+        std::fill_n(probs, numClasses, 0.f);
+        rtrees->evaluate(ft, probs);
+    }
+    #ifdef WITH_GBT
+    else {
+        thread_local std::vector<double> dft;
+        thread_local std::vector<double> dprobs;
+        dft.resize(numFeatures);
+        dprobs.resize(numClasses);
+
+        std::copy(ft, ft + numFeatures, dft.begin());
+        booster->Predict(dft.data(), dprobs.data(), &earlyStop);
+        std::copy(dprobs.begin(), dprobs.end(), probs);
+    }
+    #endif
+}
+
+void Model::classify(PointSet &pointSet,
+    const std::vector<Feature *> &features,
+    const std::vector<Label> &labels,
+    const Regularization regularization,
+    const double regRadius,
+    const bool useColors,
+    const bool unclassifiedOnly,
+    const bool evaluate,
+    const std::vector<int> &skip,
+    const std::string &statsFile,
+    const bool confidence,
+    const bool probabilities,
+    const int smoothHops) const {
+    if (type == RandomForest) {
+        rf::classify(pointSet, rtrees, features, labels, regularization,
+            regRadius, useColors, unclassifiedOnly, evaluate, skip, statsFile, confidence, probabilities, smoothHops);
+    }
+    #ifdef WITH_GBT
+    else {
+        gbm::classify(pointSet, booster, features, labels, regularization,
+            regRadius, useColors, unclassifiedOnly, evaluate, skip, statsFile, confidence, probabilities, smoothHops);
+    }
+    #endif
+}
+
+bool Model::compatible(const Model &other) const {
+    return std::abs(resolution - other.resolution) < 1e-9 &&
+        std::abs(radius - other.radius) < 1e-9 &&
+        numScales == other.numScales &&
+        momentScales == other.momentScales;
+}
+
+Model::~Model() {
+    if (rtrees != nullptr) delete rtrees;
+    #ifdef WITH_GBT
+    if (booster != nullptr) delete booster;
+    #endif
+}
@@ -0,0 +1,54 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include "classifier.hpp"
+#include "randomforest.hpp"
+
+#ifdef WITH_GBT
+#include "gbm.hpp"
+#endif
+
+// A classification model of either type, along with
+// the scale parameters it was trained with
+struct Model {
+    ClassifierType type;
+    std::string filename;
+
+    double resolution;
+    double radius;
+    int numScales;
+    unsigned int momentScales = 0;
+    size_t numFeatures;
+    size_t numClasses;
+
+    rf::RandomForest *rtrees = nullptr;
+    #ifdef WITH_GBT
+    gbm::Boosting *booster = nullptr;
+    LightGBM::PredictionEarlyStopInstance earlyStop;
+    #endif
+
+    // Thread-safe, probs must have room for numClasses values
+    void evaluate(const float *ft, float *probs) const;
+
+    void classify(PointSet &pointSet,
+        const std::vector<Feature *> &features,
+        const std::vector<Label> &labels,
+        Regularization regularization = Regularization::None,
+        double regRadius = 2.5,
+        bool useColors = false,
+        bool unclassifiedOnly = false,
+        bool evaluate = false,
+        const std::vector<int> &skip = {},
+        const std::string &statsFile = "",
+        bool confidence = false,
+        bool probabilities = false,
+        int smoothHops = SMOOTH_HOPS) const;
+
+    bool compatible(const Model &other) const;
+
+    ~Model();
+};
+
+Model *loadModel(const std::string &modelFile);
+
+#endif
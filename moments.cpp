@@ -0,0 +1,90 @@
+#include "moments.hpp"
+
+// 21 bits per axis, offset so that negative indices can be packed
+#define KEY_OFFSET (1LL << 20)
+
+static inline uint64_t packKey(const int64_t r, const int64_t c, const int64_t d) {
+    return (static_cast<uint64_t>(r & 0x1FFFFF) << 42) |
+        (static_cast<uint64_t>(c & 0x1FFFFF) << 21) |
+        static_cast<uint64_t>(d & 0x1FFFFF);
+}
+
+void VoxelMoments::add(const VoxelMoments &other) {
+    count += other.count;
+    for (size_t i = 0; i < 3; i++) sum[i] += other.sum[i];
+    for (size_t i = 0; i < 6; i++) sqSum[i] += other.sqSum[i];
+    zMin = std::min(zMin, other.zMin);
+    zMax = std::max(zMax, other.zMax);
+}
+
+MomentPyramid::MomentPyramid(const PointSet &pSet, const double resolution, const size_t numLevels) :
+    origin({ pSet.points[0][0], pSet.points[0][1], pSet.points[0][2] }), resolution(resolution), levels(numLevels) {
+    logStream() << "Computing voxel moments (" << numLevels << " levels) ..." << std::endl;
+
+    auto &base = levels[0];
+    for (size_t i = 0; i < pSet.count(); i++) {
+        const auto v = voxelIndex(pSet.points[i], 0);
+        VoxelMoments &m = base[packKey(v[0], v[1], v[2])];
+
+        const double x = pSet.points[i][0] - origin[0];
+        const double y = pSet.points[i][1] - origin[1];
+        const double z = pSet.points[i][2] - origin[2];
+
+        m.count += 1.0;
+        m.sum[0] += x;
+        m.sum[1] += y;
+        m.sum[2] += z;
+        m.sqSum[0] += x * x;
+        m.sqSum[1] += x * y;
+        m.sqSum[2] += x * z;
+        m.sqSum[3] += y * y;
+        m.sqSum[4] += y * z;
+        m.sqSum[5] += z * z;
+        m.zMin = std::min(m.zMin, pSet.points[i][2]);
+        m.zMax = std::max(m.zMax, pSet.points[i][2]);
+    }
+
+    for (size_t l = 1; l < numLevels; l++) {
+        for (const auto &it : levels[l - 1]) {
+            const int64_t r = static_cast<int64_t>((it.first >> 42) & 0x1FFFFF) >> 1;
+            const int64_t c = static_cast<int64_t>((it.first >> 21) & 0x1FFFFF) >> 1;
+            const int64_t d = static_cast<int64_t>(it.first & 0x1FFFFF) >> 1;
+            levels[l][packKey(r, c, d)].add(it.second);
+        }
+    }
+}
+
+std::array<int64_t, 3> MomentPyramid::voxelIndex(const std::array<float, 3> &p, const size_t level) const {
+    std::array<int64_t, 3> v;
+    for (size_t i = 0; i < 3; i++) {
+        v[i] = (static_cast<int64_t>(std::floor((p[i] - origin[i]) / resolution)) + KEY_OFFSET) >> level;
+    }
+    return v;
+}
+
+VoxelMoments MomentPyramid::neighborhood(const std::array<float, 3> &p, const size_t level) const {
+    const auto &voxels = levels[level];
+    const auto v = voxelIndex(p, level);
+    VoxelMoments m;
+
+    for (int64_t i = -1; i <= 1; i++) {
+        for (int64_t j = -1; j <= 1; j++) {
+            for (int64_t k = -1; k <= 1; k++) {
+                const auto it = voxels.find(packKey(v[0] + i, v[1] + j, v[2] + k));
+                if (it != voxels.end()) m.add(it->second);
+            }
+        }
+    }
+
+    return m;
+}
+
+unsigned int parseMomentScales(const std::vector<int> &scaleIds, const int numScales) {
+    unsigned int mask = 0;
+    for (const int id : scaleIds) {
+        const int maxId = std::min(numScales, MAX_MOMENT_SCALE);
+        if (id < 2 || id > maxId) throw std::runtime_error("Invalid moment scale " + std::to_string(id) + " (must be between 2 and " + std::to_string(maxId) + ")");
+        mask |= 1u << (id - 1);
+    }
+    return mask;
+}
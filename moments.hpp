@@ -0,0 +1,43 @@
+#ifndef MOMENTS_H
+#define MOMENTS_H
+
+#include <unordered_map>
+#include <limits>
+#include "point_io.hpp"
+
+// Scales whose features are derived from voxel moments are stored as a bit mask
+// (bit i = scale i + 1), which limits them to the first MAX_MOMENT_SCALE scales
+#define MAX_MOMENT_SCALE 32
+
+// First and second order moments of the points within a voxel
+// (coordinates are relative to the pyramid origin)
+struct VoxelMoments {
+    double count = 0.0;
+    std::array<double, 3> sum = { 0.0, 0.0, 0.0 };
+    std::array<double, 6> sqSum = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 }; // xx, xy, xz, yy, yz, zz
+    float zMin = std::numeric_limits<float>::max();
+    float zMax = std::numeric_limits<float>::lowest();
+
+    void add(const VoxelMoments &other);
+};
+
+// Voxel moments of a point set on grids of resolution * 2^level,
+// each level is aggregated from the one below
+class MomentPyramid {
+    std::array<double, 3> origin;
+    double resolution;
+    std::vector<std::unordered_map<uint64_t, VoxelMoments> > levels;
+
+    std::array<int64_t, 3> voxelIndex(const std::array<float, 3> &p, size_t level) const;
+public:
+    MomentPyramid(const PointSet &pSet, double resolution, size_t numLevels);
+
+    inline const std::array<double, 3> &getOrigin() const { return origin; }
+
+    // Sum of the moments of the 3x3x3 voxel block around p
+    VoxelMoments neighborhood(const std::array<float, 3> &p, size_t level) const;
+};
+
+unsigned int parseMomentScales(const std::vector<int> &scaleIds, int numScales);
+
+#endif
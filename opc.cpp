@@ -0,0 +1,158 @@
+#include <omp.h>
+#include <memory>
+#include <mutex>
+
+#include "opc.h"
+#include "model.hpp"
+#include "scale.hpp"
+
+struct opc_model {
+    Model *model;
+};
+
+static thread_local std::string lastError;
+
+// Passes complete log lines to the callback set with opc_set_log_callback (discarded if none)
+struct LogBuffer : std::streambuf {
+    std::mutex mutex;
+    opc_log_callback callback = nullptr;
+    void *userData = nullptr;
+
+    int overflow(int c) override {
+        if (c != traits_type::eof()) append(static_cast<char>(c));
+        return c;
+    }
+
+    std::streamsize xsputn(const char *s, std::streamsize n) override {
+        for (std::streamsize i = 0; i < n; i++) append(s[i]);
+        return n;
+    }
+
+    // Lines are buffered per thread so that concurrent calls do not interleave
+    void append(char c) {
+        static thread_local std::string line;
+        if (c != '\n') {
+            line += c;
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (callback != nullptr) callback(line.c_str(), userData);
+        line.clear();
+    }
+};
+
+static LogBuffer logBuffer;
+
+// Restores the calling thread's OpenMP thread count
+struct ThreadCountGuard {
+    int prevThreads;
+    ThreadCountGuard(int numThreads) : prevThreads(omp_get_max_threads()) {
+        if (numThreads > 0) omp_set_num_threads(numThreads);
+    }
+    ~ThreadCountGuard() {
+        omp_set_num_threads(prevThreads);
+    }
+};
+
+// Scales and features created for a single call
+struct ClassifyState {
+    PointSet pSet;
+    std::vector<Scale *> scales;
+    std::vector<Feature *> features;
+
+    ~ClassifyState() {
+        for (size_t i = 0; i < scales.size(); i++) delete scales[i];
+        for (size_t i = 0; i < features.size(); i++) delete features[i];
+        pSet.freeIndex<KdTree>();
+    }
+};
+
+extern "C" {
+
+void opc_set_log_callback(opc_log_callback callback, void *user_data) {
+    std::lock_guard<std::mutex> lock(logBuffer.mutex);
+    logBuffer.callback = callback;
+    logBuffer.userData = user_data;
+}
+
+opc_model *opc_load_model(const char *filename) {
+    try {
+        setLogBuffer(&logBuffer);
+        if (filename == nullptr) throw std::runtime_error("filename is null");
+        return new opc_model{ loadModel(filename) };
+    }
+    catch (const std::exception &e) {
+        lastError = e.what();
+        return nullptr;
+    }
+}
+
+void opc_free_model(opc_model *model) {
+    if (model == nullptr) return;
+    delete model->model;
+    delete model;
+}
+
+double opc_model_resolution(const opc_model *model) {
+    return model->model->resolution;
+}
+
+int opc_model_num_scales(const opc_model *model) {
+    return model->model->numScales;
+}
+
+int opc_classify(const opc_model *model, size_t count,
+    const float *xyz, size_t xyz_stride,
+    const uint8_t *rgb, size_t rgb_stride,
+    uint8_t *labels, uint8_t *confidence, uint8_t *margin,
+    int regularization, double reg_radius, int num_threads) {
+    try {
+        if (model == nullptr || xyz == nullptr || labels == nullptr) throw std::runtime_error("model, xyz and labels cannot be null");
+        if (count == 0) return 0;
+        if (regularization != OPC_REGULARIZATION_NONE && regularization != OPC_REGULARIZATION_LOCAL_SMOOTH &&
+            regularization != OPC_REGULARIZATION_GRAPH_SMOOTH) throw std::runtime_error("Invalid regularization");
+
+        setLogBuffer(&logBuffer);
+        ThreadCountGuard threads(num_threads);
+        const Model *m = model->model;
+
+        // The input is only read by the base scale, which voxelizes
+        // its own copy of the points, so the caller's buffers are viewed in place
+        ClassifyState state;
+        PointSet &pSet = state.pSet;
+        pSet.setView(count, xyz, xyz_stride, rgb, rgb_stride);
+
+        const Regularization reg = regularization == OPC_REGULARIZATION_LOCAL_SMOOTH ? Regularization::LocalSmooth :
+            regularization == OPC_REGULARIZATION_GRAPH_SMOOTH ? Regularization::GraphSmooth : Regularization::None;
+        const bool withConfidence = confidence != nullptr || margin != nullptr;
+
+        ScaleOptions scaleOptions;
+        scaleOptions.momentScales = m->momentScales;
+        scaleOptions.knnGraph = reg == Regularization::GraphSmooth;
+        state.scales = computeScales(m->numScales, &pSet, m->resolution, m->radius, scaleOptions);
+        state.features = getFeatures(state.scales);
+        m->classify(pSet, state.features, getTrainingLabels(), reg, reg_radius,
+            false, false, false, {}, "", withConfidence, false);
+
+        std::copy(pSet.labels.begin(), pSet.labels.end(), labels);
+        if (withConfidence) {
+            for (size_t i = 0; i < count; i++) {
+                if (confidence != nullptr) confidence[i] = pSet.confidence[i][0];
+                if (margin != nullptr) margin[i] = pSet.confidence[i][1];
+            }
+        }
+
+        return 0;
+    }
+    catch (const std::exception &e) {
+        lastError = e.what();
+        return -1;
+    }
+}
+
+const char *opc_last_error(void) {
+    return lastError.c_str();
+}
+
+}
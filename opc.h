@@ -0,0 +1,72 @@
+#ifndef OPC_H
+#define OPC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32)
+#  ifdef OPC_EXPORTS
+#    define OPC_API __declspec(dllexport)
+#  else
+#    define OPC_API __declspec(dllimport)
+#  endif
+#else
+#  define OPC_API __attribute__((visibility("default")))
+#endif
+
+typedef struct opc_model opc_model;
+
+#define OPC_REGULARIZATION_NONE 0
+#define OPC_REGULARIZATION_LOCAL_SMOOTH 1
+#define OPC_REGULARIZATION_GRAPH_SMOOTH 2
+
+/* Load a random forest or GBT model. Returns NULL on failure (see opc_last_error) */
+OPC_API opc_model *opc_load_model(const char *filename);
+OPC_API void opc_free_model(opc_model *model);
+
+/* Scale parameters the model was trained with */
+OPC_API double opc_model_resolution(const opc_model *model);
+OPC_API int opc_model_num_scales(const opc_model *model);
+
+/*
+ * Classify count points. A model can be shared by several threads
+ * classifying different buffers at the same time. The xyz and rgb
+ * buffers are read in place (not copied) during the call.
+ *
+ * xyz: x,y,z floats of the first point, then one point every xyz_stride bytes
+ *      (0 = tightly packed)
+ * rgb: red,green,blue bytes, one point every rgb_stride bytes (0 = tightly packed),
+ *      can be NULL
+ * labels: receives count ASPRS classification codes
+ * confidence, margin: optional (can be NULL), receive count quantized (0-255)
+ *      top-1 probabilities and margins to the second best class
+ * num_threads: threads used for this call (0 = OpenMP default)
+ *
+ * Returns 0 on success, -1 on failure (see opc_last_error)
+ */
+OPC_API int opc_classify(const opc_model *model, size_t count,
+    const float *xyz, size_t xyz_stride,
+    const uint8_t *rgb, size_t rgb_stride,
+    uint8_t *labels, uint8_t *confidence, uint8_t *margin,
+    int regularization, double reg_radius, int num_threads);
+
+/*
+ * Receives log messages (one line at a time, without the newline). Log messages are
+ * discarded unless a callback is set. The callback can be called from any thread,
+ * but never from two threads at once. NULL discards log messages again
+ */
+typedef void (*opc_log_callback)(const char *message, void *user_data);
+OPC_API void opc_set_log_callback(opc_log_callback callback, void *user_data);
+
+/* Message of the last error on the calling thread */
+OPC_API const char *opc_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
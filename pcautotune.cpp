@@ -0,0 +1,204 @@
+#include <chrono>
+#include <iomanip>
+
+#include "constants.hpp"
+#include "point_io.hpp"
+#include "model.hpp"
+#include "scale.hpp"
+#include "tuning.hpp"
+
+#include "vendor/cxxopts.hpp"
+
+// Discards the output of the stages being timed
+struct NullBuffer : std::streambuf {
+    int overflow(int c) override { return c; }
+};
+
+struct Candidate {
+    omp_sched_t schedule;
+    int chunk;
+};
+
+static std::string describe(const Candidate &c) {
+    return scheduleName(c.schedule) + (c.chunk > 0 ? "," + std::to_string(c.chunk) : "");
+}
+
+// Keep the points within a centered square holding roughly maxPoints points
+static PointSet *samplePointSet(PointSet *pSet, const size_t maxPoints) {
+    if (pSet->count() <= maxPoints) return pSet;
+
+    float minX = std::numeric_limits<float>::max(), minY = minX;
+    float maxX = std::numeric_limits<float>::lowest(), maxY = maxX;
+    for (const auto &p : pSet->points) {
+        minX = std::min(minX, p[0]); maxX = std::max(maxX, p[0]);
+        minY = std::min(minY, p[1]); maxY = std::max(maxY, p[1]);
+    }
+
+    const float f = std::sqrt(static_cast<float>(maxPoints) / pSet->count()) / 2.0f;
+    const float cx = (minX + maxX) / 2.0f, cy = (minY + maxY) / 2.0f;
+    const float hx = (maxX - minX) * f, hy = (maxY - minY) * f;
+
+    auto *sample = new PointSet();
+    for (size_t i = 0; i < pSet->count(); i++) {
+        const auto &p = pSet->points[i];
+        if (std::abs(p[0] - cx) <= hx && std::abs(p[1] - cy) <= hy) {
+            sample->appendPoint(*pSet, i);
+            if (pSet->hasLabels()) sample->labels.push_back(pSet->labels[i]);
+        }
+    }
+
+    RELEASE_POINTSET(pSet);
+    return sample;
+}
+
+int main(int argc, char **argv) {
+    cxxopts::Options options("pcautotune", "Finds the fastest kd-tree and scheduling settings for this machine and writes a tuning profile");
+    options.add_options()
+        ("i,input", "Point cloud to run the benchmarks on", cxxopts::value<std::string>())
+        ("m,model", "Classification model (provides the scale parameters)", cxxopts::value<std::string>()->default_value("model.bin"))
+        ("o,output", "Output tuning profile (JSON)", cxxopts::value<std::string>()->default_value("tuning.json"))
+        ("max-points", "Benchmark on a sample of approximately this many points", cxxopts::value<int>()->default_value("500000"))
+        ("reg-radius", "Regularization radius used to benchmark local smoothing (meters)", cxxopts::value<double>()->default_value("2.5"))
+        ("repeat", "Run each benchmark this many times and keep the fastest run", cxxopts::value<int>()->default_value("3"))
+        ("h,help", "Print usage")
+        ;
+    options.parse_positional({ "input", "model" });
+    options.positional_help("[point cloud] [classification model]");
+    cxxopts::ParseResult result;
+    try {
+        result = options.parse(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        std::cerr << options.help() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (result.count("help") || !result.count("input")) {
+        std::cout << options.help() << std::endl;
+        return 0;
+    }
+
+    try {
+        const auto outputFile = result["output"].as<std::string>();
+        const auto regRadius = result["reg-radius"].as<double>();
+        const auto repeat = std::max(1, result["repeat"].as<int>());
+        const Model *model = loadModel(result["model"].as<std::string>());
+        PointSet *pSet = samplePointSet(readPointSet(result["input"].as<std::string>()), result["max-points"].as<int>());
+        const auto labels = getTrainingLabels();
+
+        std::cout << "Benchmarking on " << pSet->count() << " points with " << omp_get_max_threads() << " threads" << std::endl;
+
+        NullBuffer nullBuffer;
+        std::streambuf *coutBuffer = std::cout.rdbuf();
+        Tuning &t = tuning();
+
+        // Times the voxelization, kd-tree and feature stages
+        const auto timeScales = [&]() {
+            double elapsed = std::numeric_limits<double>::max();
+            std::cout.rdbuf(&nullBuffer);
+            for (int r = 0; r < repeat; r++) {
+                const auto start = std::chrono::steady_clock::now();
+                ScaleOptions scaleOptions;
+                scaleOptions.momentScales = model->momentScales;
+                const auto scales = computeScales(model->numScales, pSet, model->resolution, model->radius, scaleOptions);
+                elapsed = std::min(elapsed, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+                for (size_t i = 0; i < scales.size(); i++) delete scales[i];
+                pSet->freeIndex<KdTree>();
+                pSet->base = nullptr;
+            }
+            std::cout.rdbuf(coutBuffer);
+            return elapsed;
+        };
+
+        const auto report = [](const std::string &name, const std::string &value, const double seconds) {
+            std::cout << "  " << std::setw(16) << name << " | " << std::setw(12) << value << " | " << std::setw(8) << std::fixed << std::setprecision(3) << seconds << "s |" << std::endl;
+        };
+
+        // Warm up caches and the thread pool
+        timeScales();
+
+        // Tune one parameter at a time, keeping the best value of the previous ones
+        double bestTime = std::numeric_limits<double>::max();
+        size_t bestLeaf = t.kdTreeLeafSize;
+        for (const size_t leaf : { 5, 10, 20, 40, 80 }) {
+            t.kdTreeLeafSize = leaf;
+            const double elapsed = timeScales();
+            report("kd-tree leaf", std::to_string(leaf), elapsed);
+            if (elapsed < bestTime) {
+                bestTime = elapsed;
+                bestLeaf = leaf;
+            }
+        }
+        t.kdTreeLeafSize = bestLeaf;
+
+        const std::vector<Candidate> buildCandidates = {
+            { omp_sched_static, 0 }, { omp_sched_dynamic, 16 }, { omp_sched_dynamic, 256 }, { omp_sched_guided, 16 }
+        };
+        bestTime = std::numeric_limits<double>::max();
+        Candidate best = buildCandidates[0];
+        for (const auto &c : buildCandidates) {
+            t.buildSchedule = c.schedule;
+            t.buildChunk = c.chunk;
+            const double elapsed = timeScales();
+            report("build schedule", describe(c), elapsed);
+            if (elapsed < bestTime) {
+                bestTime = elapsed;
+                best = c;
+            }
+        }
+        t.buildSchedule = best.schedule;
+        t.buildChunk = best.chunk;
+
+        // Smoothing is timed as part of classification, inference takes the same time for all candidates
+        std::cout.rdbuf(&nullBuffer);
+        ScaleOptions scaleOptions;
+        scaleOptions.momentScales = model->momentScales;
+        const auto scales = computeScales(model->numScales, pSet, model->resolution, model->radius, scaleOptions);
+        const auto features = getFeatures(scales);
+        std::cout.rdbuf(coutBuffer);
+
+        const std::vector<Candidate> smoothCandidates = {
+            { omp_sched_dynamic, 1 }, { omp_sched_dynamic, 16 }, { omp_sched_guided, 1 }, { omp_sched_static, 0 }
+        };
+        bestTime = std::numeric_limits<double>::max();
+        best = smoothCandidates[0];
+        for (const auto &c : smoothCandidates) {
+            t.smoothSchedule = c.schedule;
+            t.smoothChunk = c.chunk;
+            double elapsed = std::numeric_limits<double>::max();
+            std::cout.rdbuf(&nullBuffer);
+            for (int r = 0; r < repeat; r++) {
+                const auto start = std::chrono::steady_clock::now();
+                model->classify(*pSet, features, labels, Regularization::LocalSmooth, regRadius);
+                elapsed = std::min(elapsed, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            }
+            std::cout.rdbuf(coutBuffer);
+            report("smooth schedule", describe(c), elapsed);
+            if (elapsed < bestTime) {
+                bestTime = elapsed;
+                best = c;
+            }
+        }
+        t.smoothSchedule = best.schedule;
+        t.smoothChunk = best.chunk;
+
+        std::cout << std::endl << "Best: kd-tree leaf " << t.kdTreeLeafSize << ", build schedule " << describe({ t.buildSchedule, t.buildChunk })
+            << ", smooth schedule " << describe({ t.smoothSchedule, t.smoothChunk }) << std::endl;
+
+        saveTuning(t, outputFile);
+        std::cout << "Tuning profile saved to " << outputFile << " (use with --tuning or OPC_TUNING)" << std::endl;
+
+        for (size_t i = 0; i < scales.size(); i++) delete scales[i];
+        for (size_t i = 0; i < features.size(); i++) delete features[i];
+        pSet->base = nullptr;
+        RELEASE_POINTSET(pSet);
+        delete model;
+    }
+    catch (std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
@@ -1,31 +1,52 @@
 #include "constants.hpp"
 #include "point_io.hpp"
 #include "classifier.hpp"
-#include "randomforest.hpp"
+#include "model.hpp"
+#include "ensemble.hpp"
+#include "region.hpp"
+#include "dedup.hpp"
+#include "featurecache.hpp"
+#include "tilefarm.hpp"
+#include "perfcounters.hpp"
 
 #include "vendor/cxxopts.hpp"
 
-#ifdef WITH_GBT
-#include "gbm.hpp"
-#endif
-
 int main(int argc, char **argv) {
     cxxopts::Options options("pcclassify", "Classifies a point cloud using a precomputed model");
     options.add_options()
-        ("i,input", "Input point cloud", cxxopts::value<std::string>())
-        ("o,output", "Output point cloud", cxxopts::value<std::string>())
-        ("m,model", "Input classification model", cxxopts::value<std::string>()->default_value("model.bin"))
-        ("r,regularization", "Regularization method (none, local_smooth)", cxxopts::value<std::string>()->default_value("local_smooth"))
+        ("i,input", "Input point cloud (- to read a PLY from stdin)", cxxopts::value<std::string>())
+        ("o,output", "Output point cloud (- to write a PLY to stdout)", cxxopts::value<std::string>())
+        ("m,model", "Input classification model(s). Multiple models with the same scale parameters can be combined", cxxopts::value<std::vector<std::string>>()->default_value("model.bin"))
+        ("fusion", "How to combine the output of multiple models (mean, priority)", cxxopts::value<std::string>()->default_value("priority"))
+        ("priority", "ASPRS classes (comma separated, highest first) that take precedence when using priority fusion", cxxopts::value<std::vector<int>>())
+        ("r,regularization", "Regularization method (none, local_smooth, graph_smooth)", cxxopts::value<std::string>()->default_value("local_smooth"))
         ("reg-radius", "Regularization radius (meters)", cxxopts::value<double>()->default_value("2.5"))
+        ("smooth-hops", "Number of averaging passes over the nearest neighbors graph (graph_smooth only)", cxxopts::value<int>()->default_value(MKSTR(SMOOTH_HOPS)))
         ("c,color", "Output a colored point cloud instead of a classified one", cxxopts::value<bool>()->default_value("false"))
         ("u,unclassified", "Only classify points that are labeled as unclassified and leave the others untouched", cxxopts::value<bool>()->default_value("false"))
         ("s,skip", "Do not apply these classification labels (comma separated) and leave them as-is", cxxopts::value<std::vector<int>>())
+        ("class-groups", "Only distinguish between these groups of ASPRS classes (comma separated groups, + separated classes, e.g. 3+4+5,6); other classes become unclassified. Simplifies random forest models for faster classification", cxxopts::value<std::string>()->default_value(""))
+        ("max-eval-depth", "Stop random forest tree traversal at this depth and use the node's class distribution (faster, less accurate; 0 = full depth)", cxxopts::value<int>()->default_value("0"))
+        ("depth-report", "Evaluate accuracy and throughput at various tree depths on the (labeled) input point cloud and write the results to this JSON file", cxxopts::value<std::string>()->default_value(""))
+        ("confidence", "Output per-point confidence and margin (0-255) as extra dimensions", cxxopts::value<bool>()->default_value("false"))
+        ("probabilities", "Output quantized (0-255) class probabilities as extra dimensions", cxxopts::value<bool>()->default_value("false"))
+        ("region", "Only reclassify points within this region (minx,miny,maxx,maxy), can be repeated. Labels outside of the region(s) are left untouched", cxxopts::value<std::vector<double>>())
+        ("halo", "Distance around the region(s) used to compute features and regularization (meters, -1 = estimate automatically)", cxxopts::value<double>()->default_value("-1"))
+        ("dedup", "Classify duplicate points (same label, closer than this tolerance in meters; 0 = identical coordinates) only once (-1 = disabled)", cxxopts::value<double>()->default_value("-1"))
+        ("cache-dir", "Reuse the features of a previous run with the same input and scale parameters from this directory, or store them there", cxxopts::value<std::string>()->default_value(""))
+        ("workers", "Classify tiles in this many single threaded worker processes, which share the model(s) (0 = disabled, POSIX only)", cxxopts::value<int>()->default_value("0"))
+        ("worker-memory", "Approximate memory limit of each worker (MB), used to size tiles", cxxopts::value<double>()->default_value("2048"))
+        ("retries", "Number of times the tiles of crashed workers are retried", cxxopts::value<int>()->default_value("2"))
+        ("quantum", "Store coarse scale coordinates as 16-bit integers at this precision (meters) to reduce memory usage (0 = disabled)", cxxopts::value<double>()->default_value("0"))
+        ("preview", "Quickly classify a preview by evaluating only one point per voxel of this scale and propagating labels to the others (2 or more, 0 = disabled)", cxxopts::value<int>()->default_value("0"))
         ("e,eval", "If the input point cloud is labeled, enable accuracy evaluation", cxxopts::value<bool>()->default_value("false"))
         ("stats-file", "Write evaluation statistics to json file", cxxopts::value<std::string>()->default_value(""))
+        ("tuning", "Tuning profile created by pcautotune (default: $OPC_TUNING, if set)", cxxopts::value<std::string>()->default_value(""))
+        ("perf", "Report hardware counters (cycles, instructions, LLC and branch misses) per stage and thread (Linux only)", cxxopts::value<bool>()->default_value("false"))
         ("h,help", "Print usage")
         ;
     options.parse_positional({ "input", "output", "model" });
-    options.positional_help("[input point cloud] [output point cloud] [input classification model]");
+    options.positional_help("[input point cloud] [output point cloud] [input classification model(s)]");
     cxxopts::ParseResult result;
     try {
         result = options.parse(argc, argv);
@@ -53,70 +74,181 @@ int main(int argc, char **argv) {
     }
 
     try {
+        initTuning(result["tuning"].as<std::string>());
+        const auto perf = result["perf"].as<bool>();
+        if (perf) perfEnable();
+
         // Read points
         const auto inputFile = result["input"].as<std::string>();
-        const auto modelFile = result["model"].as<std::string>();
+        const auto modelFiles = result["model"].as<std::vector<std::string>>();
         const auto outputFile = result["output"].as<std::string>();
+        if (outputFile == "-") redirectLogsToStderr();
         std::vector<int> skip = {};
         if (result.count("skip")) skip = result["skip"].as<std::vector<int>>();
+        std::vector<int> priority = {};
+        if (result.count("priority")) priority = result["priority"].as<std::vector<int>>();
+
+        std::vector<Model *> models;
+        for (const auto &modelFile : modelFiles) models.push_back(loadModel(modelFile));
 
-        ClassifierType ctype = fingerprint(modelFile);
-        #ifndef WITH_GBT
-        if (ctype == GradientBoostedTrees) throw std::runtime_error(modelFile + " is a GBT model but GBT support has not been built (try building with -DWITH_GBT=ON)");
-        #endif
-
-        std::cout << "Model: " << (ctype == RandomForest ? "Random Forest" : "Gradient Boosted Trees") << std::endl;
-        rf::RandomForest *rtrees;
-        #ifdef WITH_GBT
-        gbm::Boosting *booster;
-        #endif
-
-        double startResolution;
-        double radius;
-        int numScales;
-
-        if (ctype == RandomForest) {
-            rtrees = rf::loadForest(modelFile);
-            startResolution = rtrees->params.resolution;
-            radius = rtrees->params.radius;
-            numScales = rtrees->params.numScales;
+        const auto maxEvalDepth = result["max-eval-depth"].as<int>();
+        if (maxEvalDepth > 0) {
+            for (auto *m : models) {
+                if (m->type != RandomForest) throw std::runtime_error("--max-eval-depth is only supported with random forest models");
+                m->rtrees->max_eval_depth = maxEvalDepth;
+            }
         }
-        #ifdef WITH_GBT
-        else {
-            booster = gbm::loadBooster(modelFile);
-            const gbm::BoosterParams p = gbm::extractBoosterParams(booster);
-            startResolution = p.resolution;
-            radius = p.radius;
-            numScales = p.numScales;
+
+        const auto classGroups = result["class-groups"].as<std::string>();
+        if (!classGroups.empty()) {
+            const auto groups = parseClassGroups(classGroups);
+            for (auto *m : models) {
+                if (m->type != RandomForest) throw std::runtime_error("--class-groups is only supported with random forest models");
+                rf::collapseForest(m->rtrees, groups);
+            }
         }
-        #endif
+
+        const Ensemble ensemble(models, parseFusionRule(result["fusion"].as<std::string>()), priority);
+
+        const double startResolution = models[0]->resolution;
+        const double radius = models[0]->radius;
+        const int numScales = models[0]->numScales;
+
+        const auto regRadius = result["reg-radius"].as<double>();
+        const auto smoothHops = result["smooth-hops"].as<int>();
+        const auto color = result["color"].as<bool>();
 
         const auto labels = getTrainingLabels();
         const auto pointSet = readPointSet(inputFile);
 
-        std::cout << "Starting resolution: " << startResolution << std::endl;
+        std::vector<Region> regions;
+        std::vector<size_t> regionIdx;
+        PointSet *target = pointSet;
+
+        if (result.count("region")) {
+            if (!pointSet->hasLabels() && !color) throw std::runtime_error("Reclassifying a region requires a classified input point cloud");
 
-        const auto features = getFeatures(computeScales(numScales, pointSet, startResolution, radius));
-        std::cout << "Features: " << features.size() << std::endl;
+            regions = parseRegions(result["region"].as<std::vector<double>>());
+            double halo = result["halo"].as<double>();
+            if (halo < 0) halo = regionHalo(startResolution, numScales, radius,
+                smoothingExtent(regularization, regRadius, smoothHops, startResolution));
+
+            target = extractRegions(*pointSet, regions, halo, regionIdx);
+        }
 
+        // Duplicates share the results of a single point
+        const auto dedup = result["dedup"].as<double>();
+        std::vector<size_t> dupMap;
+        PointSet *withDuplicates = target;
+        if (dedup >= 0) target = collapseDuplicates(*withDuplicates, dedup, dupMap);
+
+        std::cout << "Starting resolution: " << startResolution << std::endl;
+
+        const auto unclassified = result["unclassified"].as<bool>();
         const auto eval = result["eval"].as<bool>();
         const auto statsFile = result["stats-file"].as<std::string>();
-        const auto regRadius = result["reg-radius"].as<double>();
-        const auto color = result["color"].as<bool>();
-        const auto unclassified = result["unclassified"].as<bool>();
+        const auto confidence = result["confidence"].as<bool>();
+        const auto probabilities = result["probabilities"].as<bool>();
+        const auto depthReportFile = result["depth-report"].as<std::string>();
+        const auto cacheDir = result["cache-dir"].as<std::string>();
+        const auto numWorkers = result["workers"].as<int>();
+
+        ScaleOptions scaleOptions;
+        scaleOptions.previewScale = result["preview"].as<int>();
+        if (scaleOptions.previewScale < 0 || scaleOptions.previewScale == 1) {
+            throw std::runtime_error("--preview must be 0 (disabled) or a scale of 2 or more (scale 1 evaluates every point)");
+        }
+        scaleOptions.quantum = result["quantum"].as<double>();
+        scaleOptions.momentScales = models[0]->momentScales;
+        scaleOptions.knnGraph = regularization == Regularization::GraphSmooth;
+
+        // Only compute features where labels can change
+        const auto setUpdateMask = [&](const PointSet &pSet, ScaleOptions &options) {
+            if (unclassified && pSet.hasLabels()) {
+                options.updateMask.resize(pSet.count());
+                for (size_t i = 0; i < pSet.count(); i++) options.updateMask[i] = pSet.labels[i] == LABEL_UNCLASSIFIED;
+                options.updateHalo = smoothingExtent(regularization, regRadius, smoothHops, startResolution);
+            }
+        };
+
+        const auto classifySet = [&](PointSet &pSet, const std::vector<Feature *> &features, const bool evaluate, const bool withProbabilities) {
+            if (models.size() == 1) {
+                models[0]->classify(pSet, features, labels, regularization,
+                    regRadius, color, unclassified, evaluate, skip, statsFile, confidence, withProbabilities, smoothHops);
+            }
+            else {
+                std::cout << "Combining " << models.size() << " models" << std::endl;
+                ensemble.classify(pSet, features, labels, regularization,
+                    regRadius, color, unclassified, evaluate, skip, statsFile, confidence, withProbabilities, smoothHops);
+            }
+        };
+
+        if (numWorkers > 0) {
+            if (color || probabilities || !depthReportFile.empty() || !cacheDir.empty() || perf) {
+                throw std::runtime_error("--color, --probabilities, --depth-report, --cache-dir and --perf are not supported with --workers");
+            }
+
+            // Tiles overlap by the distance that can influence their points
+            const double tileHalo = regionHalo(startResolution, numScales, radius,
+                smoothingExtent(regularization, regRadius, smoothHops, startResolution));
+            const size_t maxTilePoints = static_cast<size_t>(result["worker-memory"].as<double>() * 1024 * 1024 / WORKER_BYTES_PER_POINT);
+            std::vector<int> owner;
+            const auto tiles = planTiles(*target, std::max<size_t>(maxTilePoints, 1), tileHalo, owner);
 
-        if (ctype == RandomForest) {
-            rf::classify(*pointSet, rtrees, features, labels, regularization,
-                regRadius, color, unclassified, eval, skip, statsFile);
+            std::vector<uint8_t> truth;
+            if (eval && target->hasLabels()) truth = target->labels;
+
+            classifyTiles(*target, tiles, owner, tileHalo, numWorkers, result["retries"].as<int>(), confidence, [&](PointSet &tile) {
+                ScaleOptions tileOptions = scaleOptions;
+                setUpdateMask(tile, tileOptions);
+                const auto scales = computeScales(numScales, &tile, startResolution, radius, tileOptions);
+                const auto features = getFeatures(scales);
+                classifySet(tile, features, false, false);
+
+                for (size_t i = 0; i < scales.size(); i++) delete scales[i];
+                for (size_t i = 0; i < features.size(); i++) delete features[i];
+                tile.base = nullptr;
+            });
+
+            if (!truth.empty()) {
+                // Labels are now ASPRS codes
+                auto asprs2train = getAsprs2TrainCodes();
+                Statistics stats(labels);
+                for (size_t i = 0; i < target->count(); i++) stats.record(asprs2train[target->labels[i]], truth[i]);
+                stats.finalize();
+                stats.print();
+                if (!statsFile.empty()) stats.writeToFile(statsFile);
+            }
         }
-        #ifdef WITH_GBT
         else {
-            gbm::classify(*pointSet, booster, features, labels, regularization,
-                regRadius, color, unclassified, eval, skip, statsFile);
+            setUpdateMask(*target, scaleOptions);
+
+            uint64_t cacheKey = 0;
+            std::vector<Feature *> features;
+            if (!cacheDir.empty()) {
+                cacheKey = featureCacheKey(*target, startResolution, radius, numScales, scaleOptions);
+                features = loadCachedFeatures(cacheDir, cacheKey, *target);
+            }
+
+            if (features.empty()) {
+                features = getFeatures(computeScales(numScales, target, startResolution, radius, scaleOptions));
+                if (!cacheDir.empty()) saveCachedFeatures(cacheDir, cacheKey, *target, features);
+            }
+            std::cout << "Features: " << features.size() << std::endl;
+
+            if (!depthReportFile.empty()) {
+                if (models[0]->type != RandomForest) throw std::runtime_error("--depth-report is only supported with random forest models");
+                rf::depthReport(*target, models[0]->rtrees, features, labels, depthReportFile);
+            }
+
+            classifySet(*target, features, eval, probabilities);
         }
-        #endif
-        
+
+        if (target != withDuplicates) expandDuplicates(*withDuplicates, *target, dupMap, color);
+        if (!regions.empty()) mergeRegions(*pointSet, *withDuplicates, regionIdx, regions, color);
+
         savePointSet(*pointSet, outputFile);
+        perfReport();
                  
     }
     catch (std::exception &e) {
@@ -0,0 +1,67 @@
+#include "constants.hpp"
+#include "point_io.hpp"
+#include "model.hpp"
+#include "evaluate.hpp"
+
+#include "vendor/cxxopts.hpp"
+
+int main(int argc, char **argv) {
+    cxxopts::Options options("pceval", "Evaluates one or more models on a labeled point cloud, computing features once");
+    options.add_options()
+        ("i,input", "Labeled point cloud to evaluate the models with", cxxopts::value<std::string>())
+        ("m,model", "Classification model(s) to evaluate", cxxopts::value<std::vector<std::string>>())
+        ("o,output", "Path where to store the evaluation report (JSON)", cxxopts::value<std::string>()->default_value("evaluation.json"))
+        ("quantum", "Store coarse scale coordinates as 16-bit integers at this precision (meters) to reduce memory usage (0 = disabled)", cxxopts::value<double>()->default_value("0"))
+        ("tuning", "Tuning profile created by pcautotune (default: $OPC_TUNING, if set)", cxxopts::value<std::string>()->default_value(""))
+        ("h,help", "Print usage")
+        ;
+    options.parse_positional({ "input", "model" });
+    options.positional_help("[labeled point cloud] [classification model(s)]");
+    cxxopts::ParseResult result;
+    try {
+        result = options.parse(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        std::cerr << options.help() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (result.count("help") || !result.count("input") || !result.count("model")) {
+        std::cout << options.help() << std::endl;
+        return 0;
+    }
+
+    try {
+        initTuning(result["tuning"].as<std::string>());
+
+        const auto inputFile = result["input"].as<std::string>();
+        const auto modelFiles = result["model"].as<std::vector<std::string>>();
+        const auto outputFile = result["output"].as<std::string>();
+
+        std::vector<Model *> models;
+        for (const auto &modelFile : modelFiles) models.push_back(loadModel(modelFile));
+
+        auto *pointSet = readPointSet(inputFile);
+
+        ScaleOptions scaleOptions;
+        scaleOptions.quantum = result["quantum"].as<double>();
+
+        json report = evaluateModels(*pointSet, models, scaleOptions);
+        report["input"] = inputFile;
+
+        std::ofstream o(outputFile);
+        if (!o.is_open()) throw std::runtime_error("Cannot write " + outputFile);
+        o << report.dump(4);
+        std::cout << "Evaluation report saved to " << outputFile << std::endl;
+
+        for (auto *m : models) delete m;
+        RELEASE_POINTSET(pointSet);
+    }
+    catch (std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
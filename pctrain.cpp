@@ -25,7 +25,15 @@ int main(int argc, char **argv) {
         ("eval-result", "Path where to store evaluation results (PLY)", cxxopts::value<std::string>()->default_value(""))
         ("stats", "Path where to store evaluation statistics (JSON)", cxxopts::value<std::string>()->default_value(""))
         ("c,classifier", "Which classifier type to use (rf = Random Forest, gbt = Gradient Boosted Trees)", cxxopts::value<std::string>()->default_value("rf"))
+        ("bin-samples", "Number of samples used to construct feature bins (GBT only)", cxxopts::value<int>()->default_value(MKSTR(BIN_SAMPLES)))
+        ("valid", "Labeled point cloud to use for early stopping, should not be the --eval point cloud (GBT only)", cxxopts::value<std::string>()->default_value(""))
+        ("early-stop", "Stop training when the --valid score does not improve for this many iterations (GBT only, 0 = disabled)", cxxopts::value<int>()->default_value(MKSTR(EARLY_STOP)))
+        ("eval-freq", "Compute training/validation metrics every N iterations (GBT only)", cxxopts::value<int>()->default_value(MKSTR(EVAL_FREQ)))
         ("classes", "Train only these classification classes (comma separated IDs)", cxxopts::value<std::vector<int>>())
+        ("moment-scales", "Compute features of these scales (comma separated, 2 or higher) from voxel moments instead of nearest neighbors (faster, approximate)", cxxopts::value<std::vector<int>>())
+        ("cv", "Run spatially blocked k-fold cross-validation with this many folds instead of training a model (RF only, 0 = disabled)", cxxopts::value<int>()->default_value("0"))
+        ("cv-block", "Size of the square blocks that are assigned to cross-validation folds (meters)", cxxopts::value<double>()->default_value("25"))
+        ("tuning", "Tuning profile created by pcautotune (default: $OPC_TUNING, if set)", cxxopts::value<std::string>()->default_value(""))
         ("h,help", "Print usage")
         ;
     options.parse_positional({ "input" });
@@ -46,6 +54,8 @@ int main(int argc, char **argv) {
     }
 
     try {
+        initTuning(result["tuning"].as<std::string>());
+
         const auto filenames = result["input"].as<std::vector<std::string>>();
         const auto modelFilename = result["output"].as<std::string>();
 
@@ -63,6 +73,9 @@ int main(int argc, char **argv) {
         std::vector<int> classes = {};
         if (result.count("classes")) classes = result["classes"].as<std::vector<int>>();
 
+        unsigned int momentScales = 0;
+        if (result.count("moment-scales")) momentScales = parseMomentScales(result["moment-scales"].as<std::vector<int>>(), scales);
+
         if (classifier != "rf" && classifier != "gbt") {
             std::cout << options.help() << std::endl;
             return EXIT_FAILURE;
@@ -77,15 +90,31 @@ int main(int argc, char **argv) {
 
         std::cout << "Using " << (classifier == "rf" ? "Random Forest" : "Gradient Boosted Trees") << std::endl;
 
+        const auto folds = result["cv"].as<int>();
+        if (folds > 0) {
+            if (classifier != "rf") throw std::runtime_error("Cross-validation is only supported with random forests");
+            rf::crossValidate(filenames, &startResolution, scales, numTrees, treeDepth, radius, maxSamples, classes,
+                folds, result["cv-block"].as<double>(), momentScales, statsFile);
+            return EXIT_SUCCESS;
+        }
+
         if (classifier == "rf") {
-            rf::RandomForest *rtrees = rf::train(filenames, &startResolution, scales, numTrees, treeDepth, radius, maxSamples, classes);
+            rf::RandomForest *rtrees = rf::train(filenames, &startResolution, scales, numTrees, treeDepth, radius, maxSamples, classes, momentScales);
             rf::saveForest(rtrees, modelFilename);
             delete rtrees;
         }
 
         #ifdef WITH_GBT
         else if (classifier == "gbt") {
-            gbm::Boosting *booster = gbm::train(filenames, &startResolution, scales, numTrees, treeDepth, radius, maxSamples, classes);
+            const auto binSamples = result["bin-samples"].as<int>();
+            const auto earlyStop = result["early-stop"].as<int>();
+            const auto evalFreq = result["eval-freq"].as<int>();
+            const auto validFilename = result["valid"].as<std::string>();
+            if (!validFilename.empty() && validFilename == evalFilename) {
+                std::cout << "Warning: " << validFilename << " is used for early stopping, the evaluation will not be held out" << std::endl;
+            }
+            gbm::Boosting *booster = gbm::train(filenames, &startResolution, scales, numTrees, treeDepth, radius, maxSamples, classes, binSamples,
+                validFilename, earlyStop, evalFreq, momentScales);
             gbm::saveBooster(booster, modelFilename);
         }
         #endif
@@ -115,7 +144,9 @@ int main(int argc, char **argv) {
             const auto evalPointSet = readPointSet(evalFilename);
 
             if (!evalPointSet->hasLabels()) throw std::runtime_error("Evaluation dataset has no labels");
-            const auto evalFeatures = getFeatures(computeScales(scales, evalPointSet, startResolution, radius));
+            ScaleOptions scaleOptions;
+            scaleOptions.momentScales = momentScales;
+            const auto evalFeatures = getFeatures(computeScales(scales, evalPointSet, startResolution, radius, scaleOptions));
             std::cout << "Features: " << evalFeatures.size() << std::endl;
 
             if (ctype == RandomForest) {
@@ -0,0 +1,101 @@
+#include <pdal/PluginHelper.hpp>
+
+#include "pdal_filter.hpp"
+#include "scale.hpp"
+
+namespace pdal {
+
+static PluginInfo const s_info{
+    "filters.opc",
+    "Classify points using an OpenPointClass model",
+    "https://github.com/uav4geo/OpenPointClass"
+};
+
+CREATE_SHARED_STAGE(OpcFilter, s_info)
+
+// Point set, scales and features created for a single view
+struct ViewState {
+    PointSet *pSet = nullptr;
+    std::vector<Scale *> scales;
+    std::vector<Feature *> features;
+
+    ~ViewState() {
+        for (size_t i = 0; i < scales.size(); i++) delete scales[i];
+        for (size_t i = 0; i < features.size(); i++) delete features[i];
+        RELEASE_POINTSET(pSet);
+    }
+};
+
+std::string OpcFilter::getName() const { return s_info.name; }
+
+OpcFilter::~OpcFilter() {
+    if (m_model != nullptr) delete m_model;
+}
+
+void OpcFilter::addArgs(ProgramArgs &args) {
+    args.add("model", "Classification model", m_modelFile, "model.bin");
+    args.add("regularization", "Regularization method (none, local_smooth, graph_smooth)", m_regularization, "local_smooth");
+    args.add("reg_radius", "Regularization radius (meters)", m_regRadius, 2.5);
+    args.add("smooth_hops", "Number of averaging passes over the nearest neighbors graph (graph_smooth only)", m_smoothHops, SMOOTH_HOPS);
+    args.add("unclassified", "Only classify points that are labeled as unclassified", m_unclassified, false);
+    args.add("skip", "Do not apply these classification labels and leave them as-is", m_skip);
+    args.add("confidence", "Add Confidence and Margin (0-255) dimensions", m_confidence, false);
+}
+
+void OpcFilter::addDimensions(PointLayoutPtr layout) {
+    layout->registerDim(Dimension::Id::Classification);
+    if (m_confidence) {
+        m_confidenceDim = layout->registerOrAssignDim("Confidence", Dimension::Type::Unsigned8);
+        m_marginDim = layout->registerOrAssignDim("Margin", Dimension::Type::Unsigned8);
+    }
+}
+
+void OpcFilter::initialize() {
+    try {
+        m_reg = parseRegularization(m_regularization);
+        m_model = loadModel(m_modelFile);
+    }
+    catch (const std::exception &e) {
+        throwError(e.what());
+    }
+}
+
+void OpcFilter::filter(PointView &view) {
+    if (view.empty()) return;
+
+    ViewState state;
+    try {
+        state.pSet = pdalPointSetFromView(view);
+        PointSet *pSet = state.pSet;
+        preparePointSet(pSet, {});
+
+        ScaleOptions scaleOptions;
+        if (m_unclassified && pSet->hasLabels()) {
+            scaleOptions.updateMask.resize(pSet->count());
+            for (size_t i = 0; i < pSet->count(); i++) scaleOptions.updateMask[i] = pSet->labels[i] == LABEL_UNCLASSIFIED;
+            scaleOptions.updateHalo = smoothingExtent(m_reg, m_regRadius, m_smoothHops, m_model->resolution);
+        }
+        scaleOptions.momentScales = m_model->momentScales;
+        scaleOptions.knnGraph = m_reg == Regularization::GraphSmooth;
+
+        state.scales = computeScales(m_model->numScales, pSet, m_model->resolution, m_model->radius, scaleOptions);
+        state.features = getFeatures(state.scales);
+
+        m_model->classify(*pSet, state.features, getTrainingLabels(), m_reg, m_regRadius,
+            false, m_unclassified, false, m_skip, "", m_confidence, false, m_smoothHops);
+    }
+    catch (const std::exception &e) {
+        throwError(e.what());
+    }
+
+    const PointSet &pSet = *state.pSet;
+    for (PointId i = 0; i < pSet.count(); i++) {
+        view.setField(Dimension::Id::Classification, i, pSet.labels[i]);
+        if (m_confidence) {
+            view.setField(m_confidenceDim, i, pSet.confidence[i][0]);
+            view.setField(m_marginDim, i, pSet.confidence[i][1]);
+        }
+    }
+}
+
+}
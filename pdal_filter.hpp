@@ -0,0 +1,44 @@
+#ifndef PDAL_FILTER_H
+#define PDAL_FILTER_H
+
+#include <pdal/Filter.hpp>
+#include <pdal/util/ProgramArgs.hpp>
+
+#include "model.hpp"
+
+namespace pdal {
+
+// filters.opc: classifies the points of each view in place
+// using a model that is loaded once for the whole pipeline.
+// Features need the neighbors of each point, so the filter is not
+// streamable (it runs in standard mode only)
+class PDAL_DLL OpcFilter : public Filter {
+public:
+    OpcFilter() : Filter() {}
+    ~OpcFilter();
+
+    std::string getName() const override;
+
+private:
+    std::string m_modelFile;
+    std::string m_regularization;
+    double m_regRadius;
+    int m_smoothHops;
+    bool m_unclassified;
+    std::vector<int> m_skip;
+    bool m_confidence;
+
+    Model *m_model = nullptr;
+    Regularization m_reg = Regularization::None;
+    Dimension::Id m_confidenceDim;
+    Dimension::Id m_marginDim;
+
+    void addArgs(ProgramArgs &args) override;
+    void addDimensions(PointLayoutPtr layout) override;
+    void initialize() override;
+    void filter(PointView &view) override;
+};
+
+}
+
+#endif
@@ -0,0 +1,195 @@
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include <omp.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "perfcounters.hpp"
+
+struct PerfThread {
+    PerfValues values = {};
+    PerfValues start = {};
+    size_t points = 0;
+};
+
+struct PerfStage {
+    std::string name;
+    bool sampled = false;
+    size_t points = 0;
+    std::vector<PerfThread> threads;
+};
+
+static bool enabled = false;
+static std::vector<PerfStage> stages;
+
+#ifdef __linux__
+// PERF_COUNT_HW_CACHE_MISSES counts last level cache misses on most CPUs
+static const std::array<uint64_t, PerfNumEvents> perfEvents = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+
+// -2: not opened yet, -1: not available
+static thread_local int counterGroup = -2;
+
+// Opens the counters of the calling thread as one group (read at once), led by the cycles counter
+static int openCounters() {
+    std::vector<int> fds;
+    for (size_t e = 0; e < PerfNumEvents; e++) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = perfEvents[e];
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        const int fd = syscall(SYS_perf_event_open, &attr, 0, -1, fds.empty() ? -1 : fds[0], 0);
+        if (fd == -1) {
+            for (const int f : fds) close(f);
+            return -1;
+        }
+        fds.push_back(fd);
+    }
+    return fds[0];
+}
+#endif
+
+bool perfEnable() {
+    #ifdef __linux__
+    if (counterGroup == -2) counterGroup = openCounters();
+    enabled = counterGroup >= 0;
+    #endif
+    if (!enabled) std::cerr << "Hardware performance counters are not available (Linux only, check /proc/sys/kernel/perf_event_paranoid)" << std::endl;
+    return enabled;
+}
+
+bool perfEnabled() {
+    return enabled;
+}
+
+void perfRead(PerfValues &values) {
+    values.fill(0);
+    #ifdef __linux__
+    if (counterGroup == -2) counterGroup = openCounters();
+    if (counterGroup < 0) return;
+
+    uint64_t buf[1 + PerfNumEvents]; // number of counters, then their values
+    if (read(counterGroup, buf, sizeof(buf)) != sizeof(buf)) return;
+    for (size_t e = 0; e < PerfNumEvents; e++) values[e] = buf[1 + e];
+    #endif
+}
+
+static PerfStage &getStage(const std::string &name, const bool sampled) {
+    for (auto &s : stages) {
+        if (s.name == name) return s;
+    }
+
+    stages.emplace_back();
+    stages.back().name = name;
+    stages.back().sampled = sampled;
+    stages.back().threads.resize(omp_get_max_threads());
+    return stages.back();
+}
+
+void perfBeginStage(const std::string &stage) {
+    if (!enabled) return;
+    PerfStage &s = getStage(stage, false);
+
+    #pragma omp parallel
+    {
+        const size_t t = omp_get_thread_num();
+        if (t < s.threads.size()) perfRead(s.threads[t].start);
+    }
+}
+
+void perfEndStage(const std::string &stage, const size_t points) {
+    if (!enabled) return;
+    PerfStage &s = getStage(stage, false);
+
+    #pragma omp parallel
+    {
+        const size_t t = omp_get_thread_num();
+        if (t < s.threads.size()) {
+            PerfValues end;
+            perfRead(end);
+            for (size_t e = 0; e < PerfNumEvents; e++) s.threads[t].values[e] += end[e] - s.threads[t].start[e];
+        }
+    }
+
+    s.points += points;
+}
+
+int perfStageId(const std::string &stage) {
+    if (!enabled) return -1;
+    getStage(stage, true);
+    for (size_t i = 0; i < stages.size(); i++) {
+        if (stages[i].name == stage) return i;
+    }
+    return -1;
+}
+
+void perfAddSample(const int stageId, const PerfValues &start, const PerfValues &end) {
+    if (stageId < 0) return;
+    const size_t t = omp_get_thread_num();
+    if (t >= stages[stageId].threads.size()) return;
+
+    // Each thread only writes its own slot
+    PerfThread &pt = stages[stageId].threads[t];
+    for (size_t e = 0; e < PerfNumEvents; e++) pt.values[e] += end[e] - start[e];
+    pt.points++;
+}
+
+static void printRow(const std::string &label, const PerfValues &v, const size_t points) {
+    const double p = static_cast<double>(std::max<size_t>(points, 1));
+    std::cout << std::left << std::setw(16) << label << std::right
+        << std::setw(12) << points
+        << std::setw(12) << std::fixed << std::setprecision(1) << v[PerfCycles] / 1e6
+        << std::setw(8) << std::setprecision(2) << (v[PerfCycles] > 0 ? static_cast<double>(v[PerfInstructions]) / v[PerfCycles] : 0.0)
+        << std::setw(12) << std::setprecision(0) << v[PerfCycles] / p
+        << std::setw(14) << std::setprecision(3) << v[PerfLLCMisses] / p
+        << std::setw(14) << v[PerfBranchMisses] / p << std::endl;
+}
+
+void perfReport() {
+    if (!enabled) return;
+
+    const auto flags = std::cout.flags();
+    const auto precision = std::cout.precision();
+
+    std::cout << std::endl << "Hardware counters (user space)" << std::endl;
+    std::cout << std::left << std::setw(16) << "Stage" << std::right << std::setw(12) << "Points" << std::setw(12) << "Mcycles"
+        << std::setw(8) << "IPC" << std::setw(12) << "Cycles/pt" << std::setw(14) << "LLC miss/pt" << std::setw(14) << "Br miss/pt" << std::endl;
+
+    for (const auto &s : stages) {
+        PerfValues total = {};
+        size_t points = s.sampled ? 0 : s.points;
+        for (const auto &t : s.threads) {
+            for (size_t e = 0; e < PerfNumEvents; e++) total[e] += t.values[e];
+            if (s.sampled) points += t.points;
+        }
+        if (total[PerfCycles] == 0) continue;
+
+        printRow(s.name + (s.sampled ? "*" : ""), total, points);
+
+        // Points are only known per thread for sampled stages, others
+        // are normalized by the stage's points to compare threads
+        if (s.threads.size() > 1) {
+            for (size_t t = 0; t < s.threads.size(); t++) {
+                if (s.threads[t].values[PerfCycles] == 0) continue;
+                printRow("  thread " + std::to_string(t), s.threads[t].values, s.sampled ? s.threads[t].points : points);
+            }
+        }
+    }
+
+    std::cout << "* sampled (1 out of every " << PERF_SAMPLE_INTERVAL << " points)" << std::endl;
+
+    std::cout.flags(flags);
+    std::cout.precision(precision);
+}
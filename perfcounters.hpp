@@ -0,0 +1,35 @@
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+// Hardware counters per pipeline stage and per thread, read with perf_event_open (Linux only).
+// All functions do nothing until perfEnable() succeeds
+
+// Loop stages measure 1 out of every PERF_SAMPLE_INTERVAL points
+#define PERF_SAMPLE_INTERVAL 64
+
+enum PerfEvent { PerfCycles = 0, PerfInstructions, PerfLLCMisses, PerfBranchMisses, PerfNumEvents };
+typedef std::array<uint64_t, PerfNumEvents> PerfValues;
+
+// Returns false if the counters cannot be opened
+bool perfEnable();
+bool perfEnabled();
+
+// User space counters of the calling thread
+void perfRead(PerfValues &values);
+
+// Measures all OpenMP threads between the two calls. Stages accumulate across calls
+void perfBeginStage(const std::string &stage);
+void perfEndStage(const std::string &stage, size_t points);
+
+// Loop stages: perfStageId is called outside of parallel regions, perfAddSample
+// adds the counters of one point measured by the calling thread
+int perfStageId(const std::string &stage);
+void perfAddSample(int stageId, const PerfValues &start, const PerfValues &end);
+
+void perfReport();
+
+#endif
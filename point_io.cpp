@@ -1,11 +1,53 @@
 #include <random>
 #include <filesystem>
+#include <cstring>
+#include <atomic>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 #include "point_io.hpp"
 #include "labels.hpp"
 
 namespace fs = std::filesystem;
 
+// Where PLY data goes when writing to "-" (stdout)
+static std::streambuf *pipeBuffer = nullptr;
+
+void redirectLogsToStderr() {
+    if (pipeBuffer == nullptr) {
+        pipeBuffer = std::cout.rdbuf();
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
+}
+
+static std::atomic<std::streambuf *> logBuffer{ nullptr };
+
+std::ostream &logStream() {
+    std::streambuf *buffer = logBuffer.load();
+    if (buffer == nullptr) return std::cout;
+
+    // One stream per thread, so that threads do not share formatting state
+    static thread_local std::ostream stream(nullptr);
+    if (stream.rdbuf() != buffer) stream.rdbuf(buffer);
+    return stream;
+}
+
+void setLogBuffer(std::streambuf *buffer) {
+    logBuffer.store(buffer);
+}
+
+void PointSet::setView(size_t count, const float *xyz, size_t xyzStride, const uint8_t *rgb, size_t rgbStride) {
+    points.clear();
+    colors.clear();
+    xyzView = reinterpret_cast<const uint8_t *>(xyz);
+    rgbView = rgb;
+    this->xyzStride = xyzStride != 0 ? xyzStride : sizeof(float) * 3;
+    this->rgbStride = rgbStride != 0 ? rgbStride : 3;
+    viewCount = count;
+}
+
 double PointSet::spacing(int kNeighbors) {
     if (m_spacing != -1) return m_spacing;
 
@@ -60,7 +102,43 @@ double PointSet::spacing(int kNeighbors) {
     return m_spacing;
 }
 
-std::string getVertexLine(std::ifstream &reader) {
+void CompactPoints::encode(const std::vector<std::array<float, 3> > &points, const float quantum) {
+    const size_t n = points.size();
+    offsets.resize(n);
+    blocks.resize((n + COMPACT_BLOCK_SIZE - 1) / COMPACT_BLOCK_SIZE);
+
+    for (size_t b = 0; b < blocks.size(); b++) {
+        const size_t start = b * COMPACT_BLOCK_SIZE;
+        const size_t end = std::min(start + COMPACT_BLOCK_SIZE, n);
+
+        std::array<float, 3> minp = points[start];
+        std::array<float, 3> maxp = points[start];
+        for (size_t i = start + 1; i < end; i++) {
+            for (size_t d = 0; d < 3; d++) {
+                minp[d] = std::min(minp[d], points[i][d]);
+                maxp[d] = std::max(maxp[d], points[i][d]);
+            }
+        }
+
+        float halfExtent = 0.f;
+        for (size_t d = 0; d < 3; d++) {
+            blocks[b][d] = (minp[d] + maxp[d]) / 2.f;
+            halfExtent = std::max(halfExtent, (maxp[d] - minp[d]) / 2.f);
+        }
+
+        // Leave some room for rounding
+        const float q = std::max(quantum, halfExtent / 32000.f);
+        blocks[b][3] = q;
+
+        for (size_t i = start; i < end; i++) {
+            for (size_t d = 0; d < 3; d++) {
+                offsets[i][d] = static_cast<int16_t>(std::lround((points[i][d] - blocks[b][d]) / q));
+            }
+        }
+    }
+}
+
+std::string getVertexLine(std::istream &reader) {
     std::string line;
 
     // Skip comments
@@ -98,12 +176,20 @@ size_t getVertexCount(const std::string &line) {
 PointSet *readPointSet(const std::string &filename) {
     PointSet *r;
     const fs::path p(filename);
-    if (p.extension().string() == ".ply") r = fastPlyReadPointSet(filename);
+    const bool isPipe = filename == "-";
+    if (isPipe || p.extension().string() == ".ply") r = fastPlyReadPointSet(filename);
     else r = pdalReadPointSet(filename);
 
+    std::unordered_map<int, std::string> mappings;
+    if (r->hasLabels() && !isPipe) mappings = getClassMappings(filename);
+    preparePointSet(r, mappings);
+
+    return r;
+}
+
+void preparePointSet(PointSet *r, const std::unordered_map<int, std::string> &mappings) {
     // Re-map labels if needed
     if (r->hasLabels()) {
-        auto mappings = getClassMappings(filename);
         const bool hasMappings = !mappings.empty();
 
         if (hasMappings) {
@@ -112,7 +198,7 @@ PointSet *readPointSet(const std::string &filename) {
                 int label = r->labels[idx];
 
                 if (mappings.find(label) != mappings.end()) {
-                    label = trainingCodes[mappings[label]];
+                    label = trainingCodes[mappings.at(label)];
                 }
                 else {
                     label = trainingCodes["unassigned"];
@@ -136,15 +222,26 @@ PointSet *readPointSet(const std::string &filename) {
         r->colors.resize(r->points.size());
         std::fill(r->colors.begin(), r->colors.end(), std::array<uint8_t, 3>{255, 255, 255});
     }
-
-    return r;
 }
 
 PointSet *fastPlyReadPointSet(const std::string &filename) {
+    if (filename == "-") {
+        #ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+        #endif
+        return fastPlyReadPointSet(std::cin);
+    }
+
     std::ifstream reader(filename, std::ios::binary);
     if (!reader.is_open())
         throw std::runtime_error("Cannot open file " + filename);
 
+    auto *r = fastPlyReadPointSet(reader);
+    reader.close();
+    return r;
+}
+
+PointSet *fastPlyReadPointSet(std::istream &reader) {
     auto *r = new PointSet();
 
     std::string line;
@@ -177,10 +274,16 @@ PointSet *fastPlyReadPointSet(const std::string &filename) {
 
     size_t redIdx = 0, greenIdx = 1, blueIdx = 2;
 
+    size_t numProps = 3;
+    size_t rowSize = sizeof(float) * 3;
+
     std::getline(reader, line);
     line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
 
     while (line != "end_header") {
+        numProps++;
+        rowSize += getPropertySize(line);
+
         if (hasHeader(line, "nx") || hasHeader(line, "normal_x") || hasHeader(line, "normalx")) hasNormals = true;
         if (hasHeader(line, "red")) {
             hasColors = true;
@@ -213,6 +316,14 @@ PointSet *fastPlyReadPointSet(const std::string &filename) {
 
     bool hasLabels = !labelDim.empty();
 
+    // Properties we don't know about (e.g. confidence values)
+    // are expected to follow the ones we read and are skipped
+    const size_t knownProps = 3 + (hasNormals ? 3 : 0) + (hasColors ? 3 : 0) + (hasViews ? 1 : 0) + (hasLabels ? 1 : 0);
+    const size_t knownSize = sizeof(float) * 3 + (hasNormals ? sizeof(float) * 3 : 0) +
+        (hasColors ? 3 : 0) + (hasViews ? 1 : 0) + (hasLabels ? 1 : 0);
+    if (numProps < knownProps || rowSize < knownSize) throw std::runtime_error("Invalid PLY file (unsupported properties)");
+    const size_t extraProps = numProps - knownProps;
+
     r->points.resize(count);
     if (hasNormals) r->normals.resize(count);
     if (hasColors) r->colors.resize(count);
@@ -254,33 +365,42 @@ PointSet *fastPlyReadPointSet(const std::string &filename) {
                 reader >> buf;
                 r->labels[i] = static_cast<uint8_t>(buf);
             }
+            for (size_t j = 0; j < extraProps; j++) {
+                reader >> line;
+            }
         }
     }
     else {
-
-        // Read points
-        uint8_t color[3];
-
-        for (size_t i = 0; i < count; i++) {
-            reader.read(reinterpret_cast<char *>(r->points[i].data()), sizeof(float) * 3);
-
-            if (hasNormals) {
-                reader.read(reinterpret_cast<char *>(r->normals[i].data()), sizeof(float) * 3);
-            }
-
-            if (hasColors) {
-                reader.read(reinterpret_cast<char *>(&color), sizeof(uint8_t) * 3);
-                r->colors[i][redIdx] = color[0];
-                r->colors[i][greenIdx] = color[1];
-                r->colors[i][blueIdx] = color[2];
-            }
-
-            if (hasViews) {
-                reader.read(reinterpret_cast<char *>(&r->views[i]), sizeof(uint8_t));
-            }
-
-            if (hasLabels) {
-                reader.read(reinterpret_cast<char *>(&r->labels[i]), sizeof(uint8_t));
+        // Read the body in large blocks (which also works for
+        // non-seekable streams) and decode rows in parallel
+        const size_t normalsOffset = sizeof(float) * 3;
+        const size_t colorsOffset = normalsOffset + (hasNormals ? sizeof(float) * 3 : 0);
+        const size_t viewsOffset = colorsOffset + (hasColors ? 3 : 0);
+        const size_t labelsOffset = viewsOffset + (hasViews ? 1 : 0);
+
+        const size_t chunkRows = std::max<size_t>(1, PLY_CHUNK_SIZE / rowSize);
+        std::vector<char> buffer(chunkRows * rowSize);
+
+        for (size_t start = 0; start < count; start += chunkRows) {
+            const size_t rows = std::min(chunkRows, count - start);
+            reader.read(buffer.data(), rows * rowSize);
+            if (static_cast<size_t>(reader.gcount()) != rows * rowSize)
+                throw std::runtime_error("Invalid PLY file (unexpected end of data)");
+
+            #pragma omp parallel for
+            for (long long int j = 0; j < rows; j++) {
+                const char *row = &buffer[j * rowSize];
+                const size_t i = start + j;
+
+                std::memcpy(r->points[i].data(), row, sizeof(float) * 3);
+                if (hasNormals) std::memcpy(r->normals[i].data(), row + normalsOffset, sizeof(float) * 3);
+                if (hasColors) {
+                    r->colors[i][redIdx] = static_cast<uint8_t>(row[colorsOffset]);
+                    r->colors[i][greenIdx] = static_cast<uint8_t>(row[colorsOffset + 1]);
+                    r->colors[i][blueIdx] = static_cast<uint8_t>(row[colorsOffset + 2]);
+                }
+                if (hasViews) r->views[i] = static_cast<uint8_t>(row[viewsOffset]);
+                if (hasLabels) r->labels[i] = static_cast<uint8_t>(row[labelsOffset]);
             }
         }
     }
@@ -309,21 +429,17 @@ PointSet *fastPlyReadPointSet(const std::string &filename) {
     // }
     // exit(1);
 
-    reader.close();
-
     return r;
 }
 
 PointSet *pdalReadPointSet(const std::string &filename) {
     #ifdef WITH_PDAL
-    std::string labelDimension;
     pdal::StageFactory factory;
     const std::string driver = pdal::StageFactory::inferReaderDriver(filename);
     if (driver.empty()) {
         throw std::runtime_error("Can't infer point cloud reader from " + filename);
     }
 
-    auto *r = new PointSet();
     pdal::Stage *s = factory.createStage(driver);
     pdal::Options opts;
     opts.add("filename", filename);
@@ -336,17 +452,55 @@ PointSet *pdalReadPointSet(const std::string &filename) {
     s->prepare(*table);
     const pdal::PointViewSet pvSet = s->execute(*table);
 
+    auto *r = pdalPointSetFromView(**pvSet.begin());
     r->pointView = *pvSet.begin();
-    const pdal::PointViewPtr pView = r->pointView;
+    r->sourceFile = filename;
+
+    // std::vector<std::size_t> classes (255, 0);
+    // for (size_t idx = 0; idx < count; idx++) {
+        // std::cout << r->points[idx][0] << " ";
+        // std::cout << r->points[idx][1] << " ";
+        // std::cout << r->points[idx][2] << " ";
+
+        // std::cout << std::to_string(r->colors[idx][0]) << " ";
+        // std::cout << std::to_string(r->colors[idx][1]) << " ";
+        // std::cout << std::to_string(r->colors[idx][2]) << " ";
+
+        // if (hasLabels){
+        //     std::cout << std::to_string(r->labels[idx]) << " ";
+        // }
+        // std::cout << std::endl;
+
+        // if (idx > 9) exit(1);
+
+    //     classes[std::size_t(r->labels[idx])]++;
+    // }
+
+    // for (size_t i = 0; i < classes.size(); i++){
+    //     std::cout << i << ": " << classes[i] << std::endl;
+    // }
+    // exit(1);
+
+    return r;
+    #else
+    fs::path p(filename);
+    throw std::runtime_error("Unsupported file extension " + p.extension().string() + ", build program with PDAL support for additional file types support.");
+    #endif
+}
 
-    if (pView->empty()) {
+#ifdef WITH_PDAL
+PointSet *pdalPointSetFromView(pdal::PointView &view) {
+    if (view.empty()) {
         throw std::runtime_error("No points could be fetched");
     }
 
-    std::cout << "Number of points: " << pView->size() << std::endl;
+    std::cout << "Number of points: " << view.size() << std::endl;
 
-    for (const auto &d : pView->dims()) {
-        std::string dim = pView->dimName(d);
+    auto *r = new PointSet();
+    std::string labelDimension;
+
+    for (const auto &d : view.dims()) {
+        std::string dim = view.dimName(d);
         if (dim == "Label" || dim == "label" ||
             dim == "Classification" || dim == "classification" ||
             dim == "Class" || dim == "class") {
@@ -354,8 +508,8 @@ PointSet *pdalReadPointSet(const std::string &filename) {
         }
     }
 
-    const size_t count = pView->size();
-    const pdal::PointLayoutPtr layout(table->layout());
+    const size_t count = view.size();
+    const pdal::PointLayoutPtr layout(view.layout());
     const bool hasLabels = !labelDimension.empty();
 
     pdal::Dimension::Id labelId;
@@ -373,7 +527,7 @@ PointSet *pdalReadPointSet(const std::string &filename) {
         r->colors.resize(count);
         hasColors = true;
         for (pdal::PointId idx = 0; idx < count; ++idx) {
-            if (pView->getFieldAs<uint16_t>(pdal::Dimension::Id::Green, idx) > 255) {
+            if (view.getFieldAs<uint16_t>(pdal::Dimension::Id::Green, idx) > 255) {
                 largeColors = true;
                 break;
             }
@@ -381,7 +535,7 @@ PointSet *pdalReadPointSet(const std::string &filename) {
     }
 
     for (pdal::PointId idx = 0; idx < count; ++idx) {
-        auto p = pView->point(idx);
+        auto p = view.point(idx);
         r->points[idx][0] = p.getFieldAs<float>(pdal::Dimension::Id::X);
         r->points[idx][1] = p.getFieldAs<float>(pdal::Dimension::Id::Y);
         r->points[idx][2] = p.getFieldAs<float>(pdal::Dimension::Id::Z);
@@ -404,39 +558,11 @@ PointSet *pdalReadPointSet(const std::string &filename) {
         }
     }
 
-    // std::vector<std::size_t> classes (255, 0);
-    // for (size_t idx = 0; idx < count; idx++) {
-        // std::cout << r->points[idx][0] << " ";
-        // std::cout << r->points[idx][1] << " ";
-        // std::cout << r->points[idx][2] << " ";
-
-        // std::cout << std::to_string(r->colors[idx][0]) << " ";
-        // std::cout << std::to_string(r->colors[idx][1]) << " ";
-        // std::cout << std::to_string(r->colors[idx][2]) << " ";
-
-        // if (hasLabels){
-        //     std::cout << std::to_string(r->labels[idx]) << " ";
-        // }
-        // std::cout << std::endl;
-
-        // if (idx > 9) exit(1);
-
-    //     classes[std::size_t(r->labels[idx])]++;
-    // }
-
-    // for (size_t i = 0; i < classes.size(); i++){
-    //     std::cout << i << ": " << classes[i] << std::endl;
-    // }
-    // exit(1);
-
     return r;
-    #else
-    fs::path p(filename);
-    throw std::runtime_error("Unsupported file extension " + p.extension().string() + ", build program with PDAL support for additional file types support.");
-    #endif
 }
+#endif
 
-void checkHeader(std::ifstream &reader, const std::string &prop) {
+void checkHeader(std::istream &reader, const std::string &prop) {
     std::string line;
     std::getline(reader, line);
     line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
@@ -451,47 +577,146 @@ bool hasHeader(const std::string &line, const std::string &prop) {
     return line.substr(0, 8) == "property" && line.substr(line.length() - prop.length(), prop.length()) == prop;
 }
 
+size_t getPropertySize(const std::string &line) {
+    std::istringstream iss(line);
+    std::string token, type;
+    iss >> token >> type;
+
+    if (token != "property") throw std::runtime_error("Invalid PLY file (expected property, but found '" + line + "')");
+    if (type == "char" || type == "uchar" || type == "int8" || type == "uint8") return 1;
+    if (type == "short" || type == "ushort" || type == "int16" || type == "uint16") return 2;
+    if (type == "int" || type == "uint" || type == "int32" || type == "uint32" ||
+        type == "float" || type == "float32") return 4;
+    if (type == "double" || type == "float64") return 8;
+
+    throw std::runtime_error("Unsupported PLY property type: " + type);
+}
+
 void savePointSet(PointSet &pSet, const std::string &filename) {
     const fs::path p(filename);
-    if (p.extension().string() == ".ply") fastPlySavePointSet(pSet, filename);
+    if (filename == "-" || p.extension().string() == ".ply") fastPlySavePointSet(pSet, filename);
     else pdalSavePointSet(pSet, filename);
 }
 
+// LAS header fields, see the ASPRS LAS 1.4 specification
+#define LAS_POINTS_OFFSET 96
+#define LAS_POINT_FORMAT 104
+#define LAS_RECORD_LENGTH 105
+#define LAS_LEGACY_COUNT 107
+#define LAS_COUNT 247
+
+#ifdef WITH_PDAL
+// Point data format of a LAS/LAZ file (compression bits cleared), or -1 if it cannot be read
+static int lasPointFormat(const std::string &filename) {
+    std::ifstream in(filename, std::ios::binary);
+    char header[LAS_POINT_FORMAT + 1];
+    if (!in.read(header, sizeof(header)) || std::memcmp(header, "LASF", 4) != 0) return -1;
+    return static_cast<uint8_t>(header[LAS_POINT_FORMAT]) & 0x3F;
+}
+#endif
+
 void pdalSavePointSet(PointSet &pSet, const std::string &filename) {
     #ifdef WITH_PDAL
+    if (lasPatchClassification(pSet, filename)) {
+        std::cout << "Wrote " << filename << " (patched classification)" << std::endl;
+        return;
+    }
+
     pdal::StageFactory factory;
     const std::string driver = pdal::StageFactory::inferWriterDriver(filename);
     if (driver.empty()) {
         throw std::runtime_error("Can't infer point cloud writer from " + filename);
     }
 
-    // Sync position, color and label data
+    // Sync the dimensions that classification can change
     if (pSet.pointView == nullptr) throw std::runtime_error("pointView is null (should not have happened)");
     const pdal::PointViewPtr pView = pSet.pointView;
 
-    for (pdal::PointId i = 0; i < pSet.count(); i++) {
-        if (pSet.hasColors()) {
+    if (pSet.hasColors() && pSet.colorsModified) {
+        for (pdal::PointId i = 0; i < pSet.count(); i++) {
             pView->setField(pdal::Dimension::Id::Red, i, pSet.colors[i][0]);
             pView->setField(pdal::Dimension::Id::Green, i, pSet.colors[i][1]);
             pView->setField(pdal::Dimension::Id::Blue, i, pSet.colors[i][2]);
         }
+    }
 
-        if (pSet.hasLabels()) {
+    if (pSet.hasLabels()) {
+        for (pdal::PointId i = 0; i < pSet.count(); i++) {
             pView->setField(pdal::Dimension::Id::Classification, i, pSet.labels[i]);
         }
     }
 
     pdal::PointTable table;
     pdal::BufferReader reader;
-    reader.addView(pView);
 
     for (const auto d : pView->dims()) {
         table.layout()->registerOrAssignDim(pView->dimName(d), pView->dimType(d));
     }
 
+    const bool hasExtraDims = pSet.hasConfidence() || pSet.hasProbabilities();
+
+    if (hasExtraDims) {
+        // The input table layout is already finalized, so points
+        // are copied to a new view that has room for the extra dimensions
+        std::vector<pdal::Dimension::Id> confidenceDims;
+        std::vector<pdal::Dimension::Id> probabilityDims;
+        const pdal::PointLayoutPtr layout = table.layout();
+
+        if (pSet.hasConfidence()) {
+            confidenceDims.push_back(layout->registerOrAssignDim("confidence", pdal::Dimension::Type::Unsigned8));
+            confidenceDims.push_back(layout->registerOrAssignDim("margin", pdal::Dimension::Type::Unsigned8));
+        }
+        if (pSet.hasProbabilities()) {
+            for (const auto &name : pSet.probabilityLabels) {
+                probabilityDims.push_back(layout->registerOrAssignDim("prob_" + name, pdal::Dimension::Type::Unsigned8));
+            }
+        }
+        table.finalize();
+
+        std::vector<std::pair<pdal::Dimension::Id, pdal::Dimension::Id> > dimMap;
+        for (const auto d : pView->dims()) {
+            dimMap.emplace_back(d, layout->findDim(pView->dimName(d)));
+        }
+
+        const pdal::PointViewPtr outView = std::make_shared<pdal::PointView>(table);
+        const size_t numProbabilities = probabilityDims.size();
+        char buf[16];
+
+        for (pdal::PointId i = 0; i < pSet.count(); i++) {
+            for (const auto &dm : dimMap) {
+                pView->getRawField(dm.first, i, buf);
+                outView->setField(dm.second, pView->dimType(dm.first), i, buf);
+            }
+
+            if (pSet.hasConfidence()) {
+                outView->setField(confidenceDims[0], i, pSet.confidence[i][0]);
+                outView->setField(confidenceDims[1], i, pSet.confidence[i][1]);
+            }
+
+            for (size_t j = 0; j < numProbabilities; j++) {
+                outView->setField(probabilityDims[j], i, pSet.probabilities[i * numProbabilities + j]);
+            }
+        }
+
+        reader.addView(outView);
+    }
+    else {
+        reader.addView(pView);
+    }
+
     pdal::Stage *s = factory.createStage(driver);
     pdal::Options opts;
     opts.add("filename", filename);
+    if (hasExtraDims && driver == "writers.las") opts.add("extra_dims", "all");
+
+    // Keep the header (scale, offsets, point format, ...) and VLRs of LAS/LAZ inputs,
+    // except for a point format without RGB when colors need to be written
+    if (driver == "writers.las" && !pSet.sourceFile.empty() &&
+        pdal::StageFactory::inferReaderDriver(pSet.sourceFile) == "readers.las") {
+        const int format = lasPointFormat(pSet.sourceFile);
+        const bool formatHasColors = format == 2 || format == 3 || format == 5 || format == 7 || format == 8 || format == 10;
+        opts.add("forward", pSet.colorsModified && !formatHasColors ? "scale,offset,vlr" : "all");
+    }
     s->setOptions(opts);
     s->setInput(reader);
 
@@ -505,9 +730,113 @@ void pdalSavePointSet(PointSet &pSet, const std::string &filename) {
     #endif
 }
 
+static bool isLasFile(const std::string &filename) {
+    std::string ext = fs::path(filename).extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == ".las";
+}
+
+bool lasPatchClassification(const PointSet &pSet, const std::string &filename) {
+    if (pSet.sourceFile.empty() || !isLasFile(pSet.sourceFile) || !isLasFile(filename)) return false;
+    if (!pSet.hasLabels() || pSet.colorsModified || pSet.hasConfidence() || pSet.hasProbabilities()) return false;
+
+    std::ifstream in(pSet.sourceFile, std::ios::binary);
+    if (!in.is_open()) return false;
+
+    char header[LAS_COUNT + sizeof(uint64_t)];
+    in.read(header, sizeof(header));
+    const size_t headerBytes = in.gcount();
+    if (headerBytes < LAS_LEGACY_COUNT + sizeof(uint32_t) || std::memcmp(header, "LASF", 4) != 0) return false;
+
+    uint32_t pointsOffset;
+    uint16_t recordLength;
+    uint32_t legacyCount;
+    std::memcpy(&pointsOffset, header + LAS_POINTS_OFFSET, sizeof(pointsOffset));
+    std::memcpy(&recordLength, header + LAS_RECORD_LENGTH, sizeof(recordLength));
+    std::memcpy(&legacyCount, header + LAS_LEGACY_COUNT, sizeof(legacyCount));
+
+    // LAS 1.4 files can leave the legacy count at 0
+    const int minorVersion = header[25];
+    uint64_t count = legacyCount;
+    if (minorVersion >= 4 && headerBytes == sizeof(header)) std::memcpy(&count, header + LAS_COUNT, sizeof(count));
+
+    // Formats with the compression bits set are LAZ data
+    const uint8_t format = header[LAS_POINT_FORMAT];
+    if (format > 10 || count != pSet.count()) return false;
+
+    // Formats 0-5 keep a 5 bit class (bits 5-7 are flags), formats 6-10 a full byte
+    const size_t classOffset = format < 6 ? 15 : 16;
+    if (recordLength <= classOffset) return false;
+    if (fs::file_size(pSet.sourceFile) < pointsOffset + count * recordLength) return false;
+    if (format < 6 && *std::max_element(pSet.labels.begin(), pSet.labels.end()) > 31) return false;
+
+    // Reading and writing the same file would clobber points not yet read
+    const bool inPlace = fs::exists(filename) && fs::equivalent(filename, pSet.sourceFile);
+    const std::string outFile = inPlace ? filename + ".tmp" : filename;
+    std::ofstream out(outFile, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) throw std::runtime_error("Cannot write to " + outFile);
+
+    const size_t chunkPoints = std::max<size_t>(1, PLY_CHUNK_SIZE / recordLength);
+    std::vector<char> buf(std::max<size_t>(pointsOffset, chunkPoints * recordLength));
+
+    // Header and VLRs
+    in.seekg(0);
+    in.read(buf.data(), pointsOffset);
+    out.write(buf.data(), pointsOffset);
+
+    for (size_t start = 0; start < count; start += chunkPoints) {
+        const size_t n = std::min(chunkPoints, count - start);
+        in.read(buf.data(), n * recordLength);
+        if (!in) throw std::runtime_error("Cannot read points from " + pSet.sourceFile);
+
+        #pragma omp parallel for
+        for (long long int i = 0; i < n; i++) {
+            auto *c = reinterpret_cast<uint8_t *>(buf.data() + i * recordLength + classOffset);
+            const uint8_t label = pSet.labels[start + i];
+            *c = format < 6 ? (*c & 0xE0) | label : label;
+        }
+
+        out.write(buf.data(), n * recordLength);
+    }
+
+    // Extended VLRs and anything else past the points
+    while (in.read(buf.data(), buf.size()) || in.gcount() > 0) {
+        out.write(buf.data(), in.gcount());
+    }
+
+    out.close();
+    if (!out) throw std::runtime_error("Cannot write to " + outFile);
+
+    if (inPlace) {
+        in.close();
+        fs::rename(outFile, filename);
+    }
+
+    return true;
+}
+
 void fastPlySavePointSet(PointSet &pSet, const std::string &filename) {
+    if (filename == "-") {
+        #ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+        #endif
+        std::ostream o(pipeBuffer != nullptr ? pipeBuffer : std::cout.rdbuf());
+        fastPlySavePointSet(pSet, o);
+        o.flush();
+        std::cout << "Wrote points to stdout" << std::endl;
+        return;
+    }
+
     std::ofstream o(filename, std::ios::binary);
+    if (!o.is_open()) throw std::runtime_error("Cannot write to " + filename);
 
+    fastPlySavePointSet(pSet, o);
+
+    o.close();
+    std::cout << "Wrote " << filename << std::endl;
+}
+
+void fastPlySavePointSet(PointSet &pSet, std::ostream &o) {
     o << "ply" << std::endl;
     o << "format binary_little_endian 1.0" << std::endl;
     o << "comment Generated by OpenPointClass" << std::endl;
@@ -538,18 +867,57 @@ void fastPlySavePointSet(PointSet &pSet, const std::string &filename) {
         o << "property uchar classification" << std::endl;
     }
 
-    o << "end_header" << std::endl;
+    const bool hasConfidence = pSet.hasConfidence();
+    const bool hasProbabilities = pSet.hasProbabilities();
+    const size_t numProbabilities = pSet.probabilityLabels.size();
 
-    for (size_t i = 0; i < pSet.count(); i++) {
-        o.write(reinterpret_cast<const char *>(pSet.points[i].data()), sizeof(float) * 3);
-        if (hasNormals) o.write(reinterpret_cast<const char *>(pSet.normals[i].data()), sizeof(float) * 3);
-        if (hasColors) o.write(reinterpret_cast<const char *>(pSet.colors[i].data()), sizeof(uint8_t) * 3);
-        if (hasViews) o.write(reinterpret_cast<const char *>(&pSet.views[i]), sizeof(uint8_t));
-        if (hasLabels) o.write(reinterpret_cast<const char *>(&pSet.labels[i]), sizeof(uint8_t));
+    if (hasConfidence) {
+        o << "property uchar confidence" << std::endl;
+        o << "property uchar margin" << std::endl;
+    }
+    if (hasProbabilities) {
+        for (const auto &name : pSet.probabilityLabels) {
+            o << "property uchar prob_" << name << std::endl;
+        }
     }
 
-    o.close();
-    std::cout << "Wrote " << filename << std::endl;
+    o << "end_header" << std::endl;
+
+    const size_t rowSize = sizeof(float) * 3 + (hasNormals ? sizeof(float) * 3 : 0) + (hasColors ? 3 : 0) +
+        (hasViews ? 1 : 0) + (hasLabels ? 1 : 0) + (hasConfidence ? 2 : 0) + (hasProbabilities ? numProbabilities : 0);
+    const size_t chunkRows = std::max<size_t>(1, PLY_CHUNK_SIZE / rowSize);
+    std::vector<char> buffer(chunkRows * rowSize);
+
+    // Encode blocks of rows in parallel, then write them out at once
+    for (size_t start = 0; start < pSet.count(); start += chunkRows) {
+        const size_t rows = std::min(chunkRows, pSet.count() - start);
+
+        #pragma omp parallel for
+        for (long long int j = 0; j < rows; j++) {
+            char *row = &buffer[j * rowSize];
+            const size_t i = start + j;
+
+            std::memcpy(row, pSet.points[i].data(), sizeof(float) * 3);
+            row += sizeof(float) * 3;
+            if (hasNormals) {
+                std::memcpy(row, pSet.normals[i].data(), sizeof(float) * 3);
+                row += sizeof(float) * 3;
+            }
+            if (hasColors) {
+                std::memcpy(row, pSet.colors[i].data(), 3);
+                row += 3;
+            }
+            if (hasViews) *row++ = static_cast<char>(pSet.views[i]);
+            if (hasLabels) *row++ = static_cast<char>(pSet.labels[i]);
+            if (hasConfidence) {
+                std::memcpy(row, pSet.confidence[i].data(), 2);
+                row += 2;
+            }
+            if (hasProbabilities) std::memcpy(row, &pSet.probabilities[i * numProbabilities], numProbabilities);
+        }
+
+        o.write(buffer.data(), rows * rowSize);
+    }
 }
 
 std::unordered_map<int, std::string> getClassMappings(const std::string &filename) {
@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <cstring>
 #ifdef WITH_PDAL
 #include <pdal/Options.hpp>
 #include <pdal/PointTable.hpp>
@@ -12,6 +13,7 @@
 
 #include "vendor/json/json.hpp"
 #include "vendor/nanoflann/nanoflann.hpp"
+#include "tuning.hpp"
 
 using json = nlohmann::json;
 
@@ -21,7 +23,8 @@ struct XYZ {
     float z;
 };
 
-#define KDTREE_MAX_LEAF 10
+// Size of the blocks used to read/write PLY data (bytes)
+#define PLY_CHUNK_SIZE (16 * 1024 * 1024)
 
 #define RELEASE_POINTSET(__POINTER) { if (__POINTER != nullptr) { __POINTER->freeIndex<KdTree>(); delete __POINTER; __POINTER = nullptr; } }
 
@@ -33,9 +36,36 @@ struct PointSet {
     std::vector<uint8_t> labels;
     std::vector<uint8_t> views;
 
+    // Quantized (0-255) top-1 probability and margin to the second best class
+    std::vector<std::array<uint8_t, 2> > confidence;
+    // Quantized class probabilities (count() x probabilityLabels.size())
+    std::vector<uint8_t> probabilities;
+    std::vector<std::string> probabilityLabels;
+
     std::vector<size_t> pointMap;
     PointSet *base = nullptr;
 
+    // File the points were read from (PDAL formats only)
+    std::string sourceFile;
+    // Set when classification results were written to colors
+    bool colorsModified = false;
+
+    // Subset of points for which features and labels are computed (all points unless evalSubset is set)
+    std::vector<size_t> evalIdx;
+    bool evalSubset = false;
+
+    // Optional kNN graph (CSR), rows of points that are not evaluated are empty
+    std::vector<size_t> graphOffsets;
+    std::vector<uint32_t> graphNeighbors;
+
+    // Optional read-only view of caller-owned strided buffers, read
+    // instead of points and colors when set (see setView)
+    const uint8_t *xyzView = nullptr;
+    const uint8_t *rgbView = nullptr;
+    size_t xyzStride = 0;
+    size_t rgbStride = 0;
+    size_t viewCount = 0;
+
     void *kdTree = nullptr;
 
     #ifdef WITH_PDAL
@@ -49,11 +79,40 @@ struct PointSet {
 
     template <typename T>
     inline T *buildIndex() {
-        if (kdTree == nullptr) kdTree = static_cast<void *>(new T(3, *this, { KDTREE_MAX_LEAF }));
+        if (isView()) throw std::runtime_error("Cannot build an index on a point view");
+        if (kdTree == nullptr) kdTree = static_cast<void *>(new T(3, *this, { tuning().kdTreeLeafSize }));
         return reinterpret_cast<T *>(kdTree);
     }
 
-    inline size_t count() const { return points.size(); }
+    // Use count points (x,y,z floats every xyzStride bytes) and colors (every rgbStride bytes,
+    // white if rgb is null) without copying them. The buffers must outlive the point set
+    void setView(size_t count, const float *xyz, size_t xyzStride, const uint8_t *rgb, size_t rgbStride);
+    inline bool isView() const { return xyzView != nullptr; }
+
+    inline float coord(const size_t idx, const size_t dim) const {
+        if (xyzView == nullptr) return points[idx][dim];
+        float v;
+        std::memcpy(&v, xyzView + idx * xyzStride + dim * sizeof(float), sizeof(float));
+        return v;
+    }
+    inline std::array<float, 3> point(const size_t idx) const {
+        if (xyzView == nullptr) return points[idx];
+        std::array<float, 3> p;
+        std::memcpy(p.data(), xyzView + idx * xyzStride, sizeof(p));
+        return p;
+    }
+    inline std::array<uint8_t, 3> color(const size_t idx) const {
+        if (xyzView == nullptr) return colors[idx];
+        if (rgbView == nullptr) return { 255, 255, 255 };
+        std::array<uint8_t, 3> c;
+        std::memcpy(c.data(), rgbView + idx * rgbStride, sizeof(c));
+        return c;
+    }
+
+    inline size_t count() const { return xyzView != nullptr ? viewCount : points.size(); }
+    inline size_t evalCount() const { return evalSubset ? evalIdx.size() : count(); }
+    inline size_t evalPoint(const size_t k) const { return evalSubset ? evalIdx[k] : k; }
+    // Only owned points are indexed (views are read once, by the base scale)
     inline size_t kdtree_get_point_count() const { return points.size(); }
     inline float kdtree_get_pt(const size_t idx, const size_t dim) const {
         return points[idx][dim];
@@ -65,8 +124,8 @@ struct PointSet {
     }
 
     void appendPoint(PointSet &src, size_t idx) {
-        points.push_back(src.points[idx]);
-        colors.push_back(src.colors[idx]);
+        points.push_back(src.point(idx));
+        colors.push_back(src.color(idx));
     }
 
     void trackPoint(PointSet &src, size_t idx) {
@@ -74,9 +133,12 @@ struct PointSet {
     }
 
     bool hasNormals() const { return normals.size() > 0; }
-    bool hasColors() const { return colors.size() > 0; }
+    bool hasColors() const { return xyzView != nullptr || colors.size() > 0; }
     bool hasViews() const { return views.size() > 0; }
     bool hasLabels() const { return labels.size() > 0; }
+    bool hasConfidence() const { return confidence.size() > 0; }
+    bool hasProbabilities() const { return probabilities.size() > 0; }
+    bool hasGraph() const { return graphOffsets.size() > 0; }
 
     double spacing(int kNeighbors = 3);
 
@@ -100,19 +162,76 @@ using KdTree = nanoflann::KDTreeSingleIndexAdaptor<
     PointSet, 3, size_t
 >;
 
-std::string getVertexLine(std::ifstream &reader);
+// Number of consecutive points that share an origin and quantum
+#define COMPACT_BLOCK_SIZE 256
+
+// Compact (6 bytes) coordinates: int16 offsets from the center of each
+// block of COMPACT_BLOCK_SIZE consecutive points, at a fixed quantum
+// (enlarged for blocks whose extent does not fit in 16 bits)
+struct CompactPoints {
+    std::vector<std::array<int16_t, 3> > offsets;
+    std::vector<std::array<float, 4> > blocks; // origin x, y, z, quantum
+
+    void encode(const std::vector<std::array<float, 3> > &points, float quantum);
+
+    inline size_t count() const { return offsets.size(); }
+    inline float get(const size_t idx, const size_t dim) const {
+        const auto &b = blocks[idx / COMPACT_BLOCK_SIZE];
+        return b[dim] + static_cast<float>(offsets[idx][dim]) * b[3];
+    }
+
+    inline size_t kdtree_get_point_count() const { return offsets.size(); }
+    inline float kdtree_get_pt(const size_t idx, const size_t dim) const {
+        return get(idx, dim);
+    }
+    template <class BBOX>
+    bool kdtree_get_bbox(BBOX & /* bb */) const
+    {
+        return false;
+    }
+};
+
+using CompactKdTree = nanoflann::KDTreeSingleIndexAdaptor<
+    nanoflann::L2_Simple_Adaptor<float, CompactPoints>,
+    CompactPoints, 3, size_t
+>;
+
+std::string getVertexLine(std::istream &reader);
 size_t getVertexCount(const std::string &line);
-inline void checkHeader(std::ifstream &reader, const std::string &prop);
+inline void checkHeader(std::istream &reader, const std::string &prop);
 inline bool hasHeader(const std::string &line, const std::string &prop);
+size_t getPropertySize(const std::string &line);
 
+// "-" reads from stdin / writes to stdout
 PointSet *fastPlyReadPointSet(const std::string &filename);
+PointSet *fastPlyReadPointSet(std::istream &reader);
 PointSet *pdalReadPointSet(const std::string &filename);
 PointSet *readPointSet(const std::string &filename);
+#ifdef WITH_PDAL
+PointSet *pdalPointSetFromView(pdal::PointView &view);
+#endif
+
+// Re-map labels to training codes and add default colors if missing
+void preparePointSet(PointSet *r, const std::unordered_map<int, std::string> &mappings);
 
 void fastPlySavePointSet(PointSet &pSet, const std::string &filename);
+void fastPlySavePointSet(PointSet &pSet, std::ostream &o);
 void pdalSavePointSet(PointSet &pSet, const std::string &filename);
 void savePointSet(PointSet &pSet, const std::string &filename);
 
+// Writes a copy of the LAS file pSet was read from with the classification byte of each
+// point replaced by pSet's labels, leaving all other bytes untouched. Returns false
+// (without writing) if the changes cannot be expressed this way
+bool lasPatchClassification(const PointSet &pSet, const std::string &filename);
+
+// Send log messages to stderr so that stdout can carry point data
+void redirectLogsToStderr();
+
+// Stream that pipeline log messages are written to: std::cout, or the buffer set
+// with setLogBuffer (which must accept writes from several threads; nullptr restores std::cout)
+std::ostream &logStream();
+void setLogBuffer(std::streambuf *buffer);
+
 
 bool fileExists(const std::string &path);
 std::unordered_map<int, std::string> getClassMappings(const std::string &filename);
@@ -1,3 +1,7 @@
+#include <chrono>
+#include <iomanip>
+#include <omp.h>
+
 #include "randomforest.hpp"
 
 namespace rf {
@@ -9,7 +13,8 @@ RandomForest *train(const std::vector<std::string> &filenames,
     const int treeDepth,
     const double radius,
     const int maxSamples,
-    const std::vector<int> &classes) {
+    const std::vector<int> &classes,
+    const unsigned int momentScales) {
 
     ForestParams params;
     params.n_trees = numTrees;
@@ -20,7 +25,7 @@ RandomForest *train(const std::vector<std::string> &filenames,
     std::vector<float> ft;
     std::vector<int> gt;
 
-    getTrainingData(filenames, startResolution, numScales, radius, maxSamples, classes,
+    getTrainingData(filenames, startResolution, numScales, radius, maxSamples, classes, momentScales,
         [&ft, &gt](const std::vector<Feature *> &features, size_t idx, int g) {
             for (std::size_t f = 0; f < features.size(); f++) {
                 ft.push_back(features[f]->getValue(idx));
@@ -39,10 +44,186 @@ RandomForest *train(const std::vector<std::string> &filenames,
     rtrees->params.resolution = *startResolution;
     rtrees->params.radius = radius;
     rtrees->params.numScales = numScales;
+    rtrees->params.momentScales = momentScales;
 
     return rtrees;
 }
 
+// Deterministically spreads blocks over folds
+static int blockFold(const std::array<float, 3> &p, const double blockSize, const int folds) {
+    const auto bx = static_cast<int32_t>(std::floor(p[0] / blockSize));
+    const auto by = static_cast<int32_t>(std::floor(p[1] / blockSize));
+    uint64_t h = (static_cast<uint64_t>(static_cast<uint32_t>(bx)) << 32) | static_cast<uint32_t>(by);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return static_cast<int>(h % static_cast<uint64_t>(folds));
+}
+
+void crossValidate(const std::vector<std::string> &filenames,
+    double *startResolution,
+    const int numScales,
+    const int numTrees,
+    const int treeDepth,
+    const double radius,
+    const int maxSamples,
+    const std::vector<int> &classes,
+    const int folds,
+    const double blockSize,
+    const unsigned int momentScales,
+    const std::string &statsFile) {
+    if (folds < 2) throw std::runtime_error("Cross-validation requires at least 2 folds");
+    if (blockSize <= 0) throw std::runtime_error("Invalid cross-validation block size");
+
+    std::vector<float> ft;
+    std::vector<int> gt;
+    std::vector<int> foldIdx;
+
+    getTrainingData(filenames, startResolution, numScales, radius, maxSamples, classes, momentScales,
+        [&ft, &gt, &foldIdx, blockSize, folds](const std::vector<Feature *> &features, size_t idx, int g) {
+            for (std::size_t f = 0; f < features.size(); f++) {
+                ft.push_back(features[f]->getValue(idx));
+            }
+            gt.push_back(g);
+
+            // Features of the first scale are indexed by base point
+            foldIdx.push_back(blockFold(features[0]->getScale()->pSet->points[idx], blockSize, folds));
+        },
+        [](size_t numFeatures, int numClasses) {});
+    if (gt.empty()) throw std::runtime_error("No training samples");
+
+    const size_t numFeatures = ft.size() / gt.size();
+    const auto labels = getTrainingLabels();
+    std::cout << "Cross-validating " << gt.size() << " samples (" << folds << " folds, " << blockSize << "m blocks)" << std::endl;
+
+    // All folds share the same feature matrix and select rows by index
+    std::vector<std::vector<int> > trainIdx(folds);
+    std::vector<std::vector<int> > testIdx(folds);
+    for (size_t i = 0; i < gt.size(); i++) {
+        for (int k = 0; k < folds; k++) {
+            if (foldIdx[i] == k) testIdx[k].push_back(i);
+            else trainIdx[k].push_back(i);
+        }
+    }
+
+    const LabelDataView label_vector(gt.data(), gt.size(), 1);
+    const FeatureDataView feature_vector(ft.data(), gt.size(), numFeatures);
+    std::vector<Statistics *> stats(folds, nullptr);
+
+    // Split the threads among folds; each fold trains its trees in parallel
+    const int maxThreads = omp_get_max_threads();
+    const int foldThreads = std::min(folds, maxThreads);
+    const int prevLevels = omp_get_max_active_levels();
+    omp_set_max_active_levels(2);
+    // Thread count of the nested (per fold) regions
+    omp_set_num_threads(std::max(1, maxThreads / foldThreads));
+
+    // Exceptions cannot leave the parallel region, rethrow them after it
+    std::vector<std::string> errors(folds);
+
+    #pragma omp parallel for num_threads(foldThreads) schedule(dynamic, 1)
+    for (int k = 0; k < folds; k++) {
+        if (trainIdx[k].empty() || testIdx[k].empty()) continue;
+
+        try {
+            ForestParams params;
+            params.n_trees = numTrees;
+            params.max_depth = treeDepth;
+            RandomForest rtrees(params);
+            const AxisAlignedRandomSplitGenerator generator;
+            rtrees.train(feature_vector, label_vector, LabelDataView(trainIdx[k].data(), trainIdx[k].size(), 1), generator, 0, false, false);
+
+            stats[k] = new Statistics(labels);
+            std::vector<float> probs(std::max<size_t>(labels.size(), rtrees.params.n_classes), 0.f);
+            for (const int i : testIdx[k]) {
+                stats[k]->record(rtrees.evaluate(&ft[i * numFeatures], probs.data()), gt[i]);
+            }
+            stats[k]->finalize();
+        }
+        catch (const std::exception &e) {
+            errors[k] = e.what();
+        }
+    }
+
+    omp_set_num_threads(maxThreads);
+    omp_set_max_active_levels(prevLevels);
+
+    for (int k = 0; k < folds; k++) {
+        if (errors[k].empty()) continue;
+        for (int f = 0; f < folds; f++) delete stats[f];
+        throw std::runtime_error("Fold " + std::to_string(k + 1) + ": " + errors[k]);
+    }
+
+    std::cout << "  " << std::setw(6) << "Fold" << " | " << std::setw(10) << "Train" << " | " << std::setw(10) << "Test" << " | " << std::setw(10) << "Accuracy" << " | " << std::setw(10) << "Avg F1" << " | " << std::endl;
+    std::cout << "  " << std::string(6, '-') << " | " << std::string(10, '-') << " | " << std::string(10, '-') << " | " << std::string(10, '-') << " | " << std::string(10, '-') << " | " << std::endl;
+
+    json j = json{
+        {"folds", json::array()},
+        {"samples", gt.size()},
+        {"block_size", blockSize}
+    };
+    std::vector<double> accuracy, f1;
+    std::map<std::string, std::vector<double> > labelF1;
+
+    for (int k = 0; k < folds; k++) {
+        std::cout << "  " << std::setw(6) << (k + 1) << " | " << std::setw(10) << trainIdx[k].size() << " | " << std::setw(10) << testIdx[k].size() << " | ";
+        if (stats[k] == nullptr) {
+            std::cout << std::setw(10) << "N/A" << " | " << std::setw(10) << "N/A" << " | " << std::endl;
+            j["folds"].push_back(nullptr);
+            continue;
+        }
+
+        std::cout << std::setw(9) << std::fixed << std::setprecision(2) << stats[k]->getAccuracy() * 100 << "% | ";
+        std::cout << std::setw(10) << std::fixed << std::setprecision(2) << stats[k]->getAvgF1() << " | " << std::endl;
+
+        json fj = stats[k]->toJson();
+        fj["train_samples"] = trainIdx[k].size();
+        fj["test_samples"] = testIdx[k].size();
+        accuracy.push_back(stats[k]->getAccuracy());
+        f1.push_back(stats[k]->getAvgF1());
+        if (fj.contains("labels")) {
+            for (const auto &l : fj["labels"].items()) {
+                if (!l.value()["f1"].is_null()) labelF1[l.key()].push_back(l.value()["f1"].get<double>());
+            }
+        }
+        j["folds"].push_back(fj);
+        delete stats[k];
+    }
+    if (accuracy.empty()) throw std::runtime_error("No fold could be evaluated, try a smaller block size");
+
+    const auto meanVar = [](const std::vector<double> &v) {
+        double mean = 0.0, var = 0.0;
+        for (const double x : v) mean += x;
+        mean /= v.size();
+        for (const double x : v) var += (x - mean) * (x - mean);
+        if (v.size() > 1) var /= (v.size() - 1);
+        return std::make_pair(mean, var);
+    };
+
+    const auto acc = meanVar(accuracy);
+    const auto avgF1 = meanVar(f1);
+    std::cout << std::endl << "  Accuracy: " << std::fixed << std::setprecision(2) << acc.first * 100 << "% (std: " << std::sqrt(acc.second) * 100 << "%)" << std::endl;
+    std::cout << "  Avg F1: " << std::fixed << std::setprecision(3) << avgF1.first << " (std: " << std::sqrt(avgF1.second) << ")" << std::endl;
+
+    j["accuracy"] = { {"mean", acc.first}, {"variance", acc.second} };
+    j["f1"] = { {"mean", avgF1.first}, {"variance", avgF1.second} };
+    for (const auto &l : labelF1) {
+        const auto mv = meanVar(l.second);
+        std::cout << "  " << std::setw(24) << l.first << " F1: " << std::fixed << std::setprecision(3) << mv.first << " (std: " << std::sqrt(mv.second) << ")" << std::endl;
+        j["labels"][l.first]["f1"] = { {"mean", mv.first}, {"variance", mv.second} };
+    }
+    std::cout << std::endl;
+
+    if (!statsFile.empty()) {
+        std::ofstream o(statsFile);
+        if (!o.is_open()) throw std::runtime_error("Cannot write " + statsFile);
+        o << j.dump(4);
+        std::cout << "Cross-validation statistics saved to " << statsFile << std::endl;
+    }
+}
+
 void saveForest(RandomForest *rtrees, const std::string &modelFilename) {
     std::ofstream ofs(modelFilename.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
     rtrees->write(ofs);
@@ -53,7 +234,7 @@ void saveForest(RandomForest *rtrees, const std::string &modelFilename) {
 RandomForest *loadForest(const std::string &modelFilename) {
     const auto rtrees = new RandomForest();
 
-    std::cout << "Loading " << modelFilename << std::endl;
+    logStream() << "Loading " << modelFilename << std::endl;
     std::ifstream ifs(modelFilename.c_str(), std::ios_base::in | std::ios_base::binary);
     if (!ifs.is_open()) throw std::runtime_error("Cannot open " + modelFilename);
     rtrees->read(ifs);
@@ -61,6 +242,193 @@ RandomForest *loadForest(const std::string &modelFilename) {
     return rtrees;
 }
 
+void depthReport(PointSet &pointSet,
+    RandomForest *rtrees,
+    const std::vector<Feature *> &features,
+    const std::vector<Label> &labels,
+    const std::string &reportFile) {
+    if (!pointSet.hasLabels()) throw std::runtime_error("A depth report requires a labeled point cloud");
+
+    std::cout << "Calibrating evaluation depth..." << std::endl;
+
+    // Use the label of the first input point that maps to each base point
+    PointSet *base = pointSet.base;
+    std::vector<int> truth(base->count(), -1);
+    for (size_t i = 0; i < pointSet.count(); i++) {
+        const size_t idx = pointSet.pointMap[i];
+        if (truth[idx] == -1 && pointSet.labels[i] != LABEL_UNASSIGNED) truth[idx] = pointSet.labels[i];
+    }
+
+    std::vector<size_t> samples;
+    for (size_t k = 0; k < base->evalCount(); k++) {
+        const size_t idx = base->evalPoint(k);
+        if (truth[idx] != -1) samples.push_back(idx);
+    }
+    if (samples.empty()) throw std::runtime_error("No labeled points to calibrate with");
+
+    const size_t maxSamples = 200000;
+    if (samples.size() > maxSamples) {
+        const size_t stride = samples.size() / maxSamples + 1;
+        size_t j = 0;
+        for (size_t i = 0; i < samples.size(); i += stride) samples[j++] = samples[i];
+        samples.resize(j);
+    }
+
+    // Precompute features so that only inference is timed
+    const size_t numFeatures = features.size();
+    std::vector<float> ft(samples.size() * numFeatures);
+
+    #pragma omp parallel for
+    for (long long int i = 0; i < samples.size(); i++) {
+        for (std::size_t f = 0; f < numFeatures; f++) {
+            ft[i * numFeatures + f] = features[f]->getValue(samples[i]);
+        }
+    }
+
+    std::vector<size_t> depths;
+    for (const size_t d : { 2, 4, 6, 8, 10, 12, 15, 20, 25 }) {
+        if (d < rtrees->params.max_depth) depths.push_back(d);
+    }
+    depths.push_back(std::numeric_limits<size_t>::max());
+
+    const size_t prevDepth = rtrees->max_eval_depth;
+    json j = json::array();
+    double fullTime = 0;
+    std::vector<std::pair<double, double> > results;
+
+    for (const size_t depth : depths) {
+        rtrees->max_eval_depth = depth;
+        size_t correct = 0;
+
+        const auto start = std::chrono::steady_clock::now();
+
+        #pragma omp parallel reduction(+:correct)
+        {
+            std::vector<float> probs(labels.size(), 0.f);
+
+            #pragma omp for
+            for (long long int i = 0; i < samples.size(); i++) {
+                const int bestClass = rtrees->evaluate(&ft[i * numFeatures], probs.data());
+                if (bestClass == truth[samples[i]]) correct++;
+            }
+        }
+
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        results.emplace_back(static_cast<double>(correct) / samples.size(), elapsed);
+    }
+
+    rtrees->max_eval_depth = prevDepth;
+    fullTime = results.back().second;
+
+    std::cout << "  " << std::setw(10) << "Depth" << " | " << std::setw(10) << "Accuracy" << " | " << std::setw(12) << "Points/s" << " | " << std::setw(8) << "Speedup" << " | " << std::endl;
+    std::cout << "  " << std::string(10, '-') << " | " << std::string(10, '-') << " | " << std::string(12, '-') << " | " << std::string(8, '-') << " | " << std::endl;
+
+    for (size_t i = 0; i < depths.size(); i++) {
+        const bool full = depths[i] == std::numeric_limits<size_t>::max();
+        const double accuracy = results[i].first;
+        const double pps = samples.size() / std::max(results[i].second, 1e-9);
+        const double speedup = fullTime / std::max(results[i].second, 1e-9);
+
+        std::cout << "  " << std::setw(10) << (full ? "full" : std::to_string(depths[i])) << " | ";
+        std::cout << std::setw(9) << std::fixed << std::setprecision(2) << accuracy * 100 << "% | ";
+        std::cout << std::setw(12) << std::fixed << std::setprecision(0) << pps << " | ";
+        std::cout << std::setw(7) << std::fixed << std::setprecision(2) << speedup << "x | " << std::endl;
+
+        j.push_back({
+            {"depth", full ? json(nullptr) : json(depths[i])},
+            {"accuracy", accuracy},
+            {"points_per_second", pps},
+            {"speedup", speedup}
+        });
+    }
+    std::cout << std::endl;
+
+    if (!reportFile.empty()) {
+        std::ofstream o(reportFile);
+        if (!o.is_open()) throw std::runtime_error("Cannot write " + reportFile);
+        o << j.dump(4);
+        std::cout << "Depth report saved to " << reportFile << std::endl;
+    }
+}
+
+typedef RandomForest::TreeType::NodeType ForestNode;
+
+static size_t countNodes(const ForestNode *node) {
+    if (node->is_leaf) return 1;
+    return 1 + countNodes(node->left.get()) + countNodes(node->right.get());
+}
+
+// Leaf distributions that only differ by the rounding of the group sums are the same
+#define COLLAPSE_EPSILON 1e-6f
+
+static bool sameDistribution(const std::vector<float> &a, const std::vector<float> &b) {
+    for (size_t c = 0; c < a.size(); c++) {
+        if (std::abs(a[c] - b[c]) > COLLAPSE_EPSILON) return false;
+    }
+    return true;
+}
+
+// Moves the distribution of each class onto its group and turns subtrees
+// whose leaves all carry the same grouped distribution into a leaf with that
+// distribution, so that the forest's (averaged) output does not change.
+// Returns true if the node is (now) such a leaf.
+static bool collapseNode(ForestNode *node, const std::vector<int> &groupOf) {
+    std::vector<float> dist(node->node_dist.size(), 0.f);
+    for (size_t c = 0; c < node->node_dist.size(); c++) {
+        dist[groupOf[c]] += node->node_dist[c];
+    }
+    node->node_dist = dist;
+
+    if (node->is_leaf) return true;
+
+    const bool left = collapseNode(node->left.get(), groupOf);
+    const bool right = collapseNode(node->right.get(), groupOf);
+
+    if (left && right && sameDistribution(node->left->node_dist, node->right->node_dist)) {
+        node->node_dist = node->left->node_dist;
+        node->left.reset();
+        node->right.reset();
+        node->is_leaf = true;
+        return true;
+    }
+
+    return false;
+}
+
+void collapseForest(RandomForest *rtrees, const std::vector<std::vector<int> > &asprsGroups) {
+    auto asprsToTrain = getAsprs2TrainCodes();
+
+    // Classes not part of a group become unclassified
+    std::vector<int> groupOf(rtrees->params.n_classes, LABEL_UNCLASSIFIED);
+    for (const auto &group : asprsGroups) {
+        // Groups are reported as their first class that the model knows about
+        int target = -1;
+        for (const int c : group) {
+            const int code = asprsToTrain[c];
+            if (code == LABEL_UNASSIGNED) throw std::runtime_error("Invalid class: " + std::to_string(c));
+            if (target == -1 && code < groupOf.size()) target = code;
+        }
+        if (target == -1) throw std::runtime_error("None of the classes of a group are known to the model (first class: " + std::to_string(group[0]) + ")");
+
+        for (const int c : group) {
+            const int code = asprsToTrain[c];
+            if (code < groupOf.size()) groupOf[code] = target;
+        }
+    }
+
+    size_t before = 0, after = 0;
+
+    #pragma omp parallel for reduction(+:before,after)
+    for (long long int i = 0; i < rtrees->trees.size(); i++) {
+        ForestNode *root = rtrees->trees[i]->root_node.get();
+        before += countNodes(root);
+        collapseNode(root, groupOf);
+        after += countNodes(root);
+    }
+
+    logStream() << "Collapsed forest to " << asprsGroups.size() << " class group(s): " << before << " --> " << after << " nodes" << std::endl;
+}
+
 void classify(PointSet &pointSet,
     RandomForest *rtrees,
     const std::vector<Feature *> &features,
@@ -71,12 +439,16 @@ void classify(PointSet &pointSet,
     const bool unclassifiedOnly,
     const bool evaluate,
     const std::vector<int> &skip,
-    const std::string &statsFile) {
+    const std::string &statsFile,
+    const bool confidence,
+    const bool probabilities,
+    const int smoothHops) {
     classifyData<float>(pointSet,
         [&rtrees](const float *ft, float *probs) {
             rtrees->evaluate(ft, probs);
         },
-        features, labels, regularization, regRadius, useColors, unclassifiedOnly, evaluate, skip, statsFile);
+        features, labels, regularization, regRadius, useColors, unclassifiedOnly, evaluate, skip, statsFile,
+        confidence, probabilities, smoothHops);
 }
 
 }
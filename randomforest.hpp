@@ -24,11 +24,36 @@ RandomForest *train(const std::vector<std::string> &filenames,
     int treeDepth,
     double radius,
     int maxSamples,
-    const std::vector<int> &classes);
+    const std::vector<int> &classes,
+    unsigned int momentScales = 0);
+
+// Spatially blocked k-fold cross-validation: samples are assigned to folds by
+// square blocks of blockSize meters, features are extracted once and the folds
+// are trained and scored concurrently
+void crossValidate(const std::vector<std::string> &filenames,
+    double *startResolution,
+    int numScales,
+    int numTrees,
+    int treeDepth,
+    double radius,
+    int maxSamples,
+    const std::vector<int> &classes,
+    int folds,
+    double blockSize,
+    unsigned int momentScales = 0,
+    const std::string &statsFile = "");
 
 RandomForest *loadForest(const std::string &modelFilename);
 void saveForest(RandomForest *rtrees, const std::string &modelFilename);
 
+void depthReport(PointSet &pointSet,
+    RandomForest *rtrees,
+    const std::vector<Feature *> &features,
+    const std::vector<Label> &labels,
+    const std::string &reportFile = "");
+
+void collapseForest(RandomForest *rtrees, const std::vector<std::vector<int> > &asprsGroups);
+
 void classify(PointSet &pointSet,
     RandomForest *rtrees,
     const std::vector<Feature *> &features,
@@ -39,7 +64,10 @@ void classify(PointSet &pointSet,
     bool unclassifiedOnly = false,
     bool evaluate = false,
     const std::vector<int> &skip = {},
-    const std::string &statsFile = "");
+    const std::string &statsFile = "",
+    bool confidence = false,
+    bool probabilities = false,
+    int smoothHops = SMOOTH_HOPS);
 
 }
 #endif
@@ -0,0 +1,94 @@
+#include "region.hpp"
+#include "labels.hpp"
+
+std::vector<Region> parseRegions(const std::vector<double> &coords) {
+    if (coords.size() % 4 != 0) throw std::runtime_error("Regions must be specified as minx,miny,maxx,maxy");
+
+    std::vector<Region> regions;
+    for (size_t i = 0; i < coords.size(); i += 4) {
+        if (coords[i] > coords[i + 2] || coords[i + 1] > coords[i + 3]) throw std::runtime_error("Invalid region (min > max)");
+        regions.emplace_back(coords[i], coords[i + 1], coords[i + 2], coords[i + 3]);
+    }
+
+    return regions;
+}
+
+bool insideRegions(const std::vector<Region> &regions, const double x, const double y, const double buffer) {
+    for (const auto &r : regions) {
+        if (r.contains(x, y, buffer)) return true;
+    }
+    return false;
+}
+
+double regionHalo(const double startResolution, const int numScales, const double radius, const double regRadius) {
+    // kNN neighborhoods at the coarsest scale span a few voxels
+    const double coarsest = startResolution * std::pow<double>(2.0, numScales - 1);
+    return 3.0 * coarsest + radius + regRadius;
+}
+
+PointSet *extractRegions(const PointSet &pSet, const std::vector<Region> &regions, const double halo, std::vector<size_t> &indices) {
+    indices.clear();
+    for (size_t i = 0; i < pSet.count(); i++) {
+        if (insideRegions(regions, pSet.points[i][0], pSet.points[i][1], halo)) indices.push_back(i);
+    }
+
+    if (indices.empty()) throw std::runtime_error("No points fall within the specified regions");
+
+    auto *r = new PointSet();
+    r->points.resize(indices.size());
+    r->colors.resize(indices.size());
+    if (pSet.hasLabels()) r->labels.resize(indices.size());
+
+    #pragma omp parallel for
+    for (long long int i = 0; i < indices.size(); i++) {
+        const size_t idx = indices[i];
+        r->points[i] = pSet.points[idx];
+        r->colors[i] = pSet.colors[idx];
+        if (pSet.hasLabels()) r->labels[i] = pSet.labels[idx];
+    }
+
+    std::cout << "Extracted " << indices.size() << " of " << pSet.count() << " points (halo: " << halo << ")" << std::endl;
+
+    return r;
+}
+
+void mergeRegions(PointSet &pSet, const PointSet &subset, const std::vector<size_t> &indices,
+    const std::vector<Region> &regions, const bool useColors) {
+    std::vector<uint8_t> updated(pSet.count(), 0);
+    const size_t numProbabilities = subset.probabilityLabels.size();
+
+    if (subset.hasConfidence()) pSet.confidence.assign(pSet.count(), { 0, 0 });
+    if (subset.hasProbabilities()) {
+        pSet.probabilities.assign(pSet.count() * numProbabilities, 0);
+        pSet.probabilityLabels = subset.probabilityLabels;
+    }
+
+    if (useColors) pSet.colorsModified = true;
+
+    // Only points within the regions (not the halo) take the new results
+    #pragma omp parallel for
+    for (long long int i = 0; i < indices.size(); i++) {
+        const size_t idx = indices[i];
+        if (!insideRegions(regions, pSet.points[idx][0], pSet.points[idx][1])) continue;
+
+        if (useColors) pSet.colors[idx] = subset.colors[i];
+        else pSet.labels[idx] = subset.labels[i];
+
+        if (subset.hasConfidence()) pSet.confidence[idx] = subset.confidence[i];
+        if (subset.hasProbabilities()) {
+            std::copy_n(&subset.probabilities[i * numProbabilities], numProbabilities,
+                &pSet.probabilities[idx * numProbabilities]);
+        }
+
+        updated[idx] = 1;
+    }
+
+    // Everything else keeps its classification (reverted to ASPRS codes)
+    if (!useColors && pSet.hasLabels()) {
+        auto train2asprsCodes = getTrain2AsprsCodes();
+
+        for (size_t i = 0; i < pSet.count(); i++) {
+            if (!updated[i]) pSet.labels[i] = train2asprsCodes[pSet.labels[i]];
+        }
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef REGION_H
+#define REGION_H
+
+#include <vector>
+#include "point_io.hpp"
+
+struct Region {
+    double minx, miny, maxx, maxy;
+
+    Region(double minx, double miny, double maxx, double maxy) :
+        minx(minx), miny(miny), maxx(maxx), maxy(maxy) {};
+
+    inline bool contains(const double x, const double y, const double buffer = 0.0) const {
+        return x >= minx - buffer && x <= maxx + buffer &&
+            y >= miny - buffer && y <= maxy + buffer;
+    }
+};
+
+std::vector<Region> parseRegions(const std::vector<double> &coords);
+bool insideRegions(const std::vector<Region> &regions, double x, double y, double buffer = 0.0);
+
+// Distance beyond a region's border that can influence
+// the features (and optionally the regularization) of points inside it
+double regionHalo(double startResolution, int numScales, double radius, double regRadius);
+
+PointSet *extractRegions(const PointSet &pSet, const std::vector<Region> &regions, double halo, std::vector<size_t> &indices);
+void mergeRegions(PointSet &pSet, const PointSet &subset, const std::vector<size_t> &indices,
+    const std::vector<Region> &regions, bool useColors);
+
+#endif
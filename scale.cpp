@@ -1,4 +1,5 @@
 #include "scale.hpp"
+#include "perfcounters.hpp"
 
 Scale::Scale(const size_t id, PointSet *pSet, const double resolution, const int kNeighbors, const double radius) :
     id(id), pSet(pSet), scaledSet(new PointSet()), resolution(resolution), kNeighbors(kNeighbors), radius(radius) {
@@ -8,7 +9,7 @@ Scale::Scale(const size_t id, PointSet *pSet, const double resolution, const int
 void Scale::init() {
     #pragma omp critical
     {
-        std::cout << "Init scale " << id << " at " << resolution << " ..." << std::endl;
+        logStream() << "Init scale " << id << " at " << resolution << " ..." << std::endl;
     }
     if (id == 0) {
         pSet->pointMap.resize(pSet->count());
@@ -25,27 +26,40 @@ void Scale::init() {
         }
     }
 
-    computeScaledSet();
+    // Moment scales do not need a decimated set or a kd-tree
+    if (moments == nullptr) computeScaledSet();
 }
 
-void Scale::build() {
-    #pragma omp critical
-    {
-        std::cout << "Building scale " << id << " (" << scaledSet->count() << " points) ..." << std::endl;
-    }
+template <typename T, typename P>
+void Scale::computeNeighborhoods(const T *index, P getPoint) {
+    omp_set_schedule(tuning().buildSchedule, tuning().buildChunk);
+    const int knnStage = perfStageId("knn");
+    const int eigenStage = perfStageId("eigen");
 
     #pragma omp parallel
     {
-        const KdTree *index = scaledSet->getIndex<KdTree>();
         Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver;
         std::vector<size_t> neighborIds(kNeighbors);
         std::vector<float> sqrDists(kNeighbors);
+        std::vector<Eigen::Vector3f> neighbors(kNeighbors);
+        PerfValues perfStart, perfKnn, perfEnd;
+
+        #pragma omp for schedule(runtime)
+        for (long long int k = 0; k < pSet->evalCount(); k++) {
+            const size_t idx = pSet->evalPoint(k);
+            const bool sample = knnStage >= 0 && k % PERF_SAMPLE_INTERVAL == 0;
+            if (sample) perfRead(perfStart);
 
-        #pragma omp for
-        for (long long int idx = 0; idx < pSet->count(); idx++) {
             index->knnSearch(pSet->points[idx].data(), kNeighbors, neighborIds.data(), sqrDists.data());
-            Eigen::Vector3f medoid = computeMedoid(neighborIds);
-            Eigen::Matrix3d covariance = computeCovariance(neighborIds, medoid);
+            for (size_t n = 0; n < neighborIds.size(); n++) neighbors[n] = getPoint(neighborIds[n]);
+            if (sample) perfRead(perfKnn);
+
+            if (keepGraph) {
+                std::copy(neighborIds.begin(), neighborIds.end(), pSet->graphNeighbors.begin() + pSet->graphOffsets[idx]);
+            }
+
+            Eigen::Vector3f medoid = computeMedoid(neighbors);
+            Eigen::Matrix3d covariance = computeCovariance(neighbors, medoid);
             solver.computeDirect(covariance);
             Eigen::Vector3d ev = solver.eigenvalues();
             for (size_t i = 0; i < 3; i++) ev[i] = std::max(ev[i], 0.0);
@@ -77,10 +91,7 @@ void Scale::build() {
             heightMin[idx] = std::numeric_limits<float>::max();
             heightMax[idx] = std::numeric_limits<float>::min();
 
-            for (size_t const &i : neighborIds) {
-                Eigen::Vector3f p(scaledSet->points[i][0],
-                    scaledSet->points[i][1],
-                    scaledSet->points[i][2]);
+            for (const Eigen::Vector3f &p : neighbors) {
                 Eigen::Vector3f n = (p - medoid);
                 const float v00 = n.dot(eigenVectors[idx].col(2));
                 const float v01 = n.dot(eigenVectors[idx].col(1));
@@ -92,23 +103,124 @@ void Scale::build() {
                 if (p[2] > heightMax[idx]) heightMax[idx] = p[2];
                 if (p[2] < heightMin[idx]) heightMin[idx] = p[2];
             }
+
+            if (sample) {
+                perfRead(perfEnd);
+                perfAddSample(knnStage, perfStart, perfKnn);
+                perfAddSample(eigenStage, perfKnn, perfEnd);
+            }
         }
+    }
+}
 
-        if (id == 1) {
+void Scale::computeMomentFeatures() {
+    const int level = static_cast<int>(id) - 1;
+    const auto &origin = moments->getOrigin();
+
+    #pragma omp parallel
+    {
+        Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver;
+
+        #pragma omp for
+        for (long long int k = 0; k < pSet->evalCount(); k++) {
+            const size_t idx = pSet->evalPoint(k);
+            const VoxelMoments m = moments->neighborhood(pSet->points[idx], level);
+            const double n = m.count;
+
+            const Eigen::Vector3d mean(m.sum[0] / n, m.sum[1] / n, m.sum[2] / n);
+            Eigen::Matrix3d sqSum;
+            sqSum << m.sqSum[0], m.sqSum[1], m.sqSum[2],
+                m.sqSum[1], m.sqSum[3], m.sqSum[4],
+                m.sqSum[2], m.sqSum[4], m.sqSum[5];
+
+            const Eigen::Matrix3d covariance = (sqSum - n * mean * mean.transpose()) / std::max(n - 1.0, 1.0);
+            solver.computeDirect(covariance);
+            Eigen::Vector3d ev = solver.eigenvalues();
+            for (size_t i = 0; i < 3; i++) ev[i] = std::max(ev[i], 0.0);
+
+            double sum = ev[0] + ev[1] + ev[2];
+            eigenValues[idx] = (ev / sum).cast<float>(); // sum-normalized
+            eigenVectors[idx] = solver.eigenvectors().cast<float>();
+
+            // Moments around the point itself (there is no medoid), scaled
+            // to the number of neighbors used by the kNN path
+            const Eigen::Vector3d c(pSet->points[idx][0] - origin[0],
+                pSet->points[idx][1] - origin[1],
+                pSet->points[idx][2] - origin[2]);
+            const Eigen::Vector3d first = n * (mean - c);
+            const Eigen::Matrix3d second = sqSum - n * (mean * c.transpose() + c * mean.transpose()) + n * c * c.transpose();
+            const double w = static_cast<double>(kNeighbors) / n;
+
+            const Eigen::Vector3d e1 = solver.eigenvectors().col(2);
+            const Eigen::Vector3d e2 = solver.eigenvectors().col(1);
+            orderAxis[idx](0, 0) = static_cast<float>(w * first.dot(e1));
+            orderAxis[idx](0, 1) = static_cast<float>(w * first.dot(e2));
+            orderAxis[idx](1, 0) = static_cast<float>(w * e1.dot(second * e1));
+            orderAxis[idx](1, 1) = static_cast<float>(w * e2.dot(second * e2));
+
+            heightMin[idx] = m.zMin;
+            heightMax[idx] = m.zMax;
+        }
+    }
+}
+
+void Scale::build() {
+    if (moments != nullptr) {
+        #pragma omp critical
+        {
+            logStream() << "Building scale " << id << " (voxel moments) ..." << std::endl;
+        }
+
+        computeMomentFeatures();
+        return;
+    }
+
+    #pragma omp critical
+    {
+        logStream() << "Building scale " << id << " (" << (compactIndex != nullptr ? compactPoints.count() : scaledSet->count()) << " points) ..." << std::endl;
+    }
+
+    if (keepGraph) {
+        // Neighbor ids are stored as 32-bit integers
+        if (scaledSet->count() > std::numeric_limits<uint32_t>::max()) throw std::runtime_error("Too many points for the nearest neighbors graph");
+
+        // Every evaluated point has kNeighbors neighbors
+        pSet->graphOffsets.assign(pSet->count() + 1, 0);
+        for (size_t k = 0; k < pSet->evalCount(); k++) pSet->graphOffsets[pSet->evalPoint(k) + 1] = kNeighbors;
+        for (size_t i = 0; i < pSet->count(); i++) pSet->graphOffsets[i + 1] += pSet->graphOffsets[i];
+        pSet->graphNeighbors.resize(pSet->graphOffsets.back());
+    }
+
+    if (compactIndex != nullptr) {
+        computeNeighborhoods(compactIndex, [this](const size_t i) {
+            return Eigen::Vector3f(compactPoints.get(i, 0), compactPoints.get(i, 1), compactPoints.get(i, 2));
+        });
+    }
+    else {
+        computeNeighborhoods(scaledSet->getIndex<KdTree>(), [this](const size_t i) {
+            return Eigen::Vector3f(scaledSet->points[i][0], scaledSet->points[i][1], scaledSet->points[i][2]);
+        });
+    }
+
+    if (id == 1) {
+        hsv.resize(scaledSet->count());
+        rgb2hsv(scaledSet->colors.data(), scaledSet->count(), hsv.data());
+
+        #pragma omp parallel
+        {
+            const KdTree *index = scaledSet->getIndex<KdTree>();
             std::vector<nanoflann::ResultItem<size_t, float>> radiusMatches;
 
             #pragma omp for
-            for (long long int idx = 0; idx < pSet->count(); idx++) {
+            for (long long int k = 0; k < pSet->evalCount(); k++) {
+                const size_t idx = pSet->evalPoint(k);
                 const size_t numMatches = index->radiusSearch(pSet->points[idx].data(), static_cast<float>(radius), radiusMatches);
                 avgHsv[idx] = { 0.f, 0.f, 0.f };
 
                 for (size_t i = 0; i < numMatches; i++) {
                     const size_t nIdx = radiusMatches[i].first;
-                    auto hsv = rgb2hsv(scaledSet->colors[nIdx][0],
-                        scaledSet->colors[nIdx][1],
-                        scaledSet->colors[nIdx][2]);
                     for (size_t j = 0; j < 3; j++)
-                        avgHsv[idx][j] += hsv[j];
+                        avgHsv[idx][j] += hsv[nIdx][j];
                 }
 
                 if (numMatches > 0) {
@@ -117,7 +229,6 @@ void Scale::build() {
                 }
             }
         }
-
     }
 }
 
@@ -127,9 +238,9 @@ void Scale::computeScaledSet() {
 
         // Voxel centroid nearest neighbor
         // Roughly from https://raw.githubusercontent.com/PDAL/PDAL/master/filters/VoxelCentroidNearestNeighborFilter.cpp
-        const double x0 = pSet->points[0][0];
-        const double y0 = pSet->points[0][1];
-        const double z0 = pSet->points[0][2];
+        const double x0 = pSet->coord(0, 0);
+        const double y0 = pSet->coord(0, 1);
+        const double z0 = pSet->coord(0, 2);
 
         typedef std::make_signed_t<std::size_t> ssize_t;
 
@@ -139,9 +250,9 @@ void Scale::computeScaledSet() {
 
         for (size_t id = 0; id < pSet->count(); id++) {
             populated_voxel_ids[std::make_tuple(
-                static_cast<ssize_t>((pSet->points[id][0] - y0) / resolution),  // r
-                static_cast<ssize_t>((pSet->points[id][1] - x0) / resolution),  // c
-                static_cast<ssize_t>((pSet->points[id][2] - z0) / resolution) // d
+                static_cast<ssize_t>((pSet->coord(id, 0) - y0) / resolution),  // r
+                static_cast<ssize_t>((pSet->coord(id, 1) - x0) / resolution),  // c
+                static_cast<ssize_t>((pSet->coord(id, 2) - z0) / resolution) // d
             )].push_back(id);
         }
 
@@ -166,14 +277,14 @@ void Scale::computeScaledSet() {
                 const double z_center = z0 + (std::get<2>(t.first) + 0.5) * resolution;
 
                 // Compute distance from first point to voxel center.
-                const double x1 = pSet->points[t.second[0]][0];
-                const double y1 = pSet->points[t.second[0]][1];
-                const double z1 = pSet->points[t.second[0]][2];
+                const double x1 = pSet->coord(t.second[0], 0);
+                const double y1 = pSet->coord(t.second[0], 1);
+                const double z1 = pSet->coord(t.second[0], 2);
                 const double d1 = std::pow<double>(x_center - x1, 2) + std::pow<double>(y_center - y1, 2) + std::pow<double>(z_center - z1, 2);
                 // Compute distance from second point to voxel center.
-                const double x2 = pSet->points[t.second[1]][0];
-                const double y2 = pSet->points[t.second[1]][1];
-                const double z2 = pSet->points[t.second[1]][2];
+                const double x2 = pSet->coord(t.second[1], 0);
+                const double y2 = pSet->coord(t.second[1], 1);
+                const double z2 = pSet->coord(t.second[1], 2);
                 const double d2 = std::pow<double>(x_center - x2, 2) + std::pow<double>(y_center - y2, 2) + std::pow<double>(z_center - z2, 2);
 
                 // Append the closer of the two.
@@ -197,9 +308,9 @@ void Scale::computeScaledSet() {
                 size_t pmin = 0;
                 double dmin((std::numeric_limits<double>::max)());
                 for (auto const &p : t.second) {
-                    const double sqr_dist = std::pow<double>(centroid[0] - pSet->points[p][0], 2) +
-                        std::pow<double>(centroid[1] - pSet->points[p][1], 2) +
-                        std::pow<double>(centroid[2] - pSet->points[p][2], 2);
+                    const double sqr_dist = std::pow<double>(centroid[0] - pSet->coord(p, 0), 2) +
+                        std::pow<double>(centroid[1] - pSet->coord(p, 1), 2) +
+                        std::pow<double>(centroid[2] - pSet->coord(p, 2), 2);
                     if (sqr_dist < dmin) {
                         dmin = sqr_dist;
                         pmin = p;
@@ -217,41 +328,49 @@ void Scale::computeScaledSet() {
         }
     }
 
-    if (id > 0) scaledSet->buildIndex<KdTree>();
+    if (id > 1 && quantum > 0) {
+        // Coarser scales are only used for neighbor lookups,
+        // so they can keep compact coordinates only
+        compactPoints.encode(scaledSet->points, static_cast<float>(quantum));
+        scaledSet->points = {};
+        scaledSet->colors = {};
+        compactIndex = new CompactKdTree(3, compactPoints, { tuning().kdTreeLeafSize });
+    }
+    else if (id > 0) scaledSet->buildIndex<KdTree>();
 }
 
 void Scale::save(const std::string &filename) {
     savePointSet(*scaledSet, filename);
 }
 
-Eigen::Matrix3d Scale::computeCovariance(const std::vector<size_t> &neighborIds, const Eigen::Vector3f &medoid) {
-    Eigen::MatrixXd A(3, neighborIds.size());
+Eigen::Matrix3d Scale::computeCovariance(const std::vector<Eigen::Vector3f> &neighbors, const Eigen::Vector3f &medoid) {
+    Eigen::MatrixXd A(3, neighbors.size());
     size_t k = 0;
 
-    for (size_t const &i : neighborIds) {
-        A(0, k) = scaledSet->points[i][0] - medoid[0];
-        A(1, k) = scaledSet->points[i][1] - medoid[1];
-        A(2, k) = scaledSet->points[i][2] - medoid[2];
+    for (const Eigen::Vector3f &p : neighbors) {
+        A(0, k) = p[0] - medoid[0];
+        A(1, k) = p[1] - medoid[1];
+        A(2, k) = p[2] - medoid[2];
         k++;
     }
 
-    return A * A.transpose() / (neighborIds.size() - 1);
+    return A * A.transpose() / (neighbors.size() - 1);
 }
 
-Eigen::Vector3f Scale::computeMedoid(const std::vector<size_t> &neighborIds) {
+Eigen::Vector3f Scale::computeMedoid(const std::vector<Eigen::Vector3f> &neighbors) {
     float mx, my, mz;
     mx = my = mz = 0.0;
     float minDist = std::numeric_limits<float>::max();
-    for (size_t const &i : neighborIds) {
+    for (const Eigen::Vector3f &pi : neighbors) {
         float sum = 0.0;
-        const float xi = scaledSet->points[i][0];
-        const float yi = scaledSet->points[i][1];
-        const float zi = scaledSet->points[i][2];
-
-        for (size_t const &j : neighborIds) {
-            sum += std::pow<double>(xi - scaledSet->points[j][0], 2) +
-                std::pow<double>(yi - scaledSet->points[j][1], 2) +
-                std::pow<double>(zi - scaledSet->points[j][2], 2);
+        const float xi = pi[0];
+        const float yi = pi[1];
+        const float zi = pi[2];
+
+        for (const Eigen::Vector3f &pj : neighbors) {
+            sum += std::pow<double>(xi - pj[0], 2) +
+                std::pow<double>(yi - pj[1], 2) +
+                std::pow<double>(zi - pj[2], 2);
         }
 
         if (sum < minDist) {
@@ -279,9 +398,9 @@ Eigen::Vector3f Scale::computeCentroid(const std::vector<size_t> &pointIds) {
             return average + delta_n;
         };
         n++;
-        mx = update(pSet->points[j][0], mx);
-        my = update(pSet->points[j][1], my);
-        mz = update(pSet->points[j][2], mz);
+        mx = update(pSet->coord(j, 0), mx);
+        my = update(pSet->coord(j, 1), my);
+        mz = update(pSet->coord(j, 2), mz);
     }
 
     Eigen::Vector3f centroid;
@@ -290,30 +409,163 @@ Eigen::Vector3f Scale::computeCentroid(const std::vector<size_t> &pointIds) {
     return centroid;
 }
 
-std::vector<Scale *> computeScales(size_t numScales, PointSet *pSet, double startResolution, double radius) {
+// Pick one base point per voxel (the one closest to the voxel center)
+// and remap all input points to it, so that only those are evaluated
+void selectPreviewPoints(PointSet *pSet, PointSet *base, const double resolution) {
+    const double x0 = base->points[0][0];
+    const double y0 = base->points[0][1];
+    const double z0 = base->points[0][2];
+
+    struct Voxel {
+        size_t idx;
+        double dist;
+    };
+    std::unordered_map<uint64_t, Voxel> voxels;
+    std::vector<uint64_t> keys(base->count());
+
+    #pragma omp parallel for
+    for (long long int i = 0; i < base->count(); i++) {
+        const auto r = static_cast<uint64_t>(static_cast<int64_t>(std::floor((base->points[i][0] - x0) / resolution)) & 0x1FFFFF);
+        const auto c = static_cast<uint64_t>(static_cast<int64_t>(std::floor((base->points[i][1] - y0) / resolution)) & 0x1FFFFF);
+        const auto d = static_cast<uint64_t>(static_cast<int64_t>(std::floor((base->points[i][2] - z0) / resolution)) & 0x1FFFFF);
+        keys[i] = (r << 42) | (c << 21) | d;
+    }
+
+    for (size_t i = 0; i < base->count(); i++) {
+        const double cx = x0 + (std::floor((base->points[i][0] - x0) / resolution) + 0.5) * resolution;
+        const double cy = y0 + (std::floor((base->points[i][1] - y0) / resolution) + 0.5) * resolution;
+        const double cz = z0 + (std::floor((base->points[i][2] - z0) / resolution) + 0.5) * resolution;
+        const double dist = std::pow<double>(base->points[i][0] - cx, 2) +
+            std::pow<double>(base->points[i][1] - cy, 2) +
+            std::pow<double>(base->points[i][2] - cz, 2);
+
+        auto it = voxels.find(keys[i]);
+        if (it == voxels.end()) voxels[keys[i]] = { i, dist };
+        else if (dist < it->second.dist) it->second = { i, dist };
+    }
+
+    base->evalIdx.clear();
+    base->evalIdx.reserve(voxels.size());
+    for (const auto &v : voxels) base->evalIdx.push_back(v.second.idx);
+    std::sort(base->evalIdx.begin(), base->evalIdx.end());
+    base->evalSubset = true;
+
+    std::vector<size_t> previewMap(base->count());
+
+    #pragma omp parallel for
+    for (long long int i = 0; i < base->count(); i++) {
+        previewMap[i] = voxels.at(keys[i]).idx;
+    }
+
+    #pragma omp parallel for
+    for (long long int i = 0; i < pSet->count(); i++) {
+        pSet->pointMap[i] = previewMap[pSet->pointMap[i]];
+    }
+
+    logStream() << "Preview: evaluating " << base->evalIdx.size() << " of " << base->count() << " points" << std::endl;
+}
+
+// Only evaluate base points that map to at least one input point that
+// can be updated, plus the base points within halo distance from those
+void selectUpdatePoints(PointSet *pSet, PointSet *base, const std::vector<bool> &updateMask, const double halo) {
+    std::vector<uint8_t> candidate(base->count(), base->evalSubset ? 0 : 1);
+    for (const size_t idx : base->evalIdx) candidate[idx] = 1;
+
+    std::vector<uint8_t> selected(base->count(), 0);
+    std::vector<size_t> needed;
+    for (size_t i = 0; i < pSet->count(); i++) {
+        const size_t idx = pSet->pointMap[i];
+        if (updateMask[i] && !selected[idx]) {
+            selected[idx] = 1;
+            needed.push_back(idx);
+        }
+    }
+
+    if (halo > 0) {
+        const auto index = base->getIndex<KdTree>();
+
+        #pragma omp parallel
+        {
+            std::vector<nanoflann::ResultItem<size_t, float>> radiusMatches;
+
+            #pragma omp for
+            for (long long int i = 0; i < needed.size(); i++) {
+                const size_t numMatches = index->radiusSearch(base->points[needed[i]].data(), static_cast<float>(halo), radiusMatches);
+                for (size_t n = 0; n < numMatches; n++) {
+                    if (candidate[radiusMatches[n].first]) {
+                        #pragma omp atomic write
+                        selected[radiusMatches[n].first] = 1;
+                    }
+                }
+            }
+        }
+    }
+
+    base->evalIdx.clear();
+    for (size_t i = 0; i < base->count(); i++) {
+        if (selected[i]) base->evalIdx.push_back(i);
+    }
+    base->evalSubset = true;
+
+    logStream() << "Evaluating " << base->evalIdx.size() << " of " << base->count() << " points (" << needed.size() << " to update)" << std::endl;
+}
+
+std::vector<Scale *> computeScales(size_t numScales, PointSet *pSet, double startResolution, double radius,
+    const ScaleOptions &options) {
     std::vector<Scale *> scales(numScales, nullptr);
 
     auto *base = new Scale(0, pSet, startResolution * std::pow<double>(2.0, 0), 10, radius);
+    perfBeginStage("voxelization");
     base->init();
+    perfEndStage("voxelization", pSet->count());
     // base->save("base.ply");
     pSet->base = base->scaledSet;
 
+    if (options.previewScale > 1) {
+        selectPreviewPoints(pSet, base->scaledSet, startResolution * std::pow<double>(2.0, options.previewScale - 1));
+    }
+
+    if (!options.updateMask.empty()) {
+        selectUpdatePoints(pSet, base->scaledSet, options.updateMask, options.updateHalo);
+    }
+
+    std::shared_ptr<const MomentPyramid> moments;
+    if (options.momentScales != 0) {
+        size_t numLevels = 0;
+        for (size_t i = 0; i < numScales; i++) {
+            if (i < MAX_MOMENT_SCALE && (options.momentScales & (1u << i))) numLevels = i + 1;
+        }
+        moments = std::make_shared<const MomentPyramid>(*base->scaledSet, startResolution, numLevels);
+    }
+
     for (size_t i = 0; i < numScales; i++) {
         scales[i] = new Scale(i + 1, base->scaledSet, startResolution * std::pow<double>(2.0, i), 10, radius);
+        scales[i]->quantum = options.quantum;
+        if (i > 0 && i < MAX_MOMENT_SCALE && (options.momentScales & (1u << i))) scales[i]->moments = moments;
     }
+    scales[0]->keepGraph = options.knnGraph;
 
     // Save some time on the first scale
+    RELEASE_POINTSET(scales[0]->scaledSet);
     scales[0]->scaledSet = base->scaledSet;
+    base->scaledSet = nullptr;
+    delete base;
 
+    perfBeginStage("voxelization");
     #pragma omp parallel for
     for (int i = 0; i < numScales; i++) {
         scales[i]->init();
     }
+    perfEndStage("voxelization", 0);
 
+    perfBeginStage("neighborhoods");
+    size_t builtPoints = 0;
     for (int i = 0; i < numScales; i++) {
         scales[i]->build();
+        builtPoints += scales[i]->pSet->evalCount();
         // scales[i]->save("scale_" + std::to_string(i + 1) + ".ply");
     }
+    perfEndStage("neighborhoods", builtPoints);
 
     return scales;
 }
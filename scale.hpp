@@ -2,7 +2,9 @@
 #define SCALE_H
 
 #include <Eigen/Dense>
+#include <memory>
 #include "point_io.hpp"
+#include "moments.hpp"
 #include "color.hpp"
 #include "constants.hpp"
 
@@ -19,22 +21,60 @@ struct Scale {
     std::vector<Eigen::Matrix2f> orderAxis;
     std::vector<float> heightMin;
     std::vector<float> heightMax;
+    std::vector<std::array<float, 3> > hsv; // Of scaledSet's colors
     std::vector<std::array<float, 3> > avgHsv;
 
-    Eigen::Matrix3d computeCovariance(const std::vector<size_t> &neighborIds, const Eigen::Vector3f &medoid);
-    Eigen::Vector3f computeMedoid(const std::vector<size_t> &neighborIds);
+    // Compact coordinates for scales > 1 (if quantum > 0)
+    double quantum = 0.0;
+    CompactPoints compactPoints;
+    CompactKdTree *compactIndex = nullptr;
+
+    // Derive features from voxel moments instead of kNN neighborhoods
+    std::shared_ptr<const MomentPyramid> moments;
+
+    // Store the kNN neighborhoods of pSet as a graph
+    bool keepGraph = false;
+
+    Eigen::Matrix3d computeCovariance(const std::vector<Eigen::Vector3f> &neighbors, const Eigen::Vector3f &medoid);
+    Eigen::Vector3f computeMedoid(const std::vector<Eigen::Vector3f> &neighbors);
     Eigen::Vector3f computeCentroid(const std::vector<size_t> &pointIds);
     void computeScaledSet();
     void save(const std::string &filename);
     void init();
     void build();
+    template <typename T, typename P>
+    void computeNeighborhoods(const T *index, P getPoint);
+    void computeMomentFeatures();
 
     Scale(size_t id, PointSet *pSet, double resolution, int kNeighbors = 10, double radius = RADIUS);
     ~Scale() {
         RELEASE_POINTSET(scaledSet);
+        if (compactIndex != nullptr) delete compactIndex;
     }
 };
 
-std::vector<Scale *> computeScales(size_t numScales, PointSet *pSet, double startResolution, double radius);
+struct ScaleOptions {
+    // Only evaluate one point per voxel of this scale (0 = all points)
+    int previewScale = 0;
+
+    // Input points that can be relabeled (empty = all) and the
+    // distance around them where points are also evaluated
+    std::vector<bool> updateMask;
+    double updateHalo = 0.0;
+
+    // Compact coordinates precision for scales > 1 (0 = use floats)
+    double quantum = 0.0;
+
+    // Scales computed from voxel moments (bit i = scale i + 1)
+    unsigned int momentScales = 0;
+
+    // Keep the kNN graph of the first scale
+    bool knnGraph = false;
+};
+
+void selectPreviewPoints(PointSet *pSet, PointSet *base, double resolution);
+void selectUpdatePoints(PointSet *pSet, PointSet *base, const std::vector<bool> &updateMask, double halo);
+std::vector<Scale *> computeScales(size_t numScales, PointSet *pSet, double startResolution, double radius,
+    const ScaleOptions &options = ScaleOptions());
 
 #endif
\ No newline at end of file
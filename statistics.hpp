@@ -26,6 +26,9 @@ class Statistics{
 
     std::map<int, Counts> stats;
     const std::vector<Label> &labels;
+
+    // Truth-major counts, indexed by training code
+    std::vector<size_t> confusion;
     size_t totalSamples = 0;
 
     double accuracy;
@@ -40,6 +43,7 @@ public:
         for (auto &label : labels){
             stats[label.getTrainingCode()] = Counts();
         }
+        confusion.assign(labels.size() * labels.size(), 0);
     }
 
     inline void record(const int predicted, const int truth){
@@ -54,6 +58,12 @@ public:
             stats[truth].fn++;
         }
 
+        const int n = static_cast<int>(labels.size());
+        if (predicted >= 0 && predicted < n && truth >= 0 && truth < n){
+            #pragma omp atomic
+            confusion[truth * labels.size() + predicted]++;
+        }
+
         #pragma omp atomic
         totalSamples++;
     }
@@ -169,13 +179,15 @@ public:
     }
 
 
-    void writeToFile(const std::string &jsonFile){
-        std::ofstream o(jsonFile);
-        if (!o.is_open()){
-            std::cerr << "Unable to create stats file" << std::endl;
-            return;
-        }
+    double getAccuracy() const{
+        return accuracy;
+    }
+
+    double getAvgF1() const{
+        return avgF1;
+    }
 
+    json toJson() const{
         json j = json{
             {"accuracy", accuracy}
         };
@@ -205,7 +217,29 @@ public:
                 j["labels"][name]["f1"] = nullptr;
         }
 
-        o << j.dump(4);
+        // Rows are ground truth, columns are predictions
+        json names = json::array();
+        json rows = json::array();
+        for (size_t t = 0; t < labels.size(); ++t){
+            names.push_back(labels[t].getName());
+            rows.push_back(std::vector<size_t>(confusion.begin() + t * labels.size(), confusion.begin() + (t + 1) * labels.size()));
+        }
+        j["confusion"] = json{
+            {"labels", names},
+            {"matrix", rows}
+        };
+
+        return j;
+    }
+
+    void writeToFile(const std::string &jsonFile){
+        std::ofstream o(jsonFile);
+        if (!o.is_open()){
+            std::cerr << "Unable to create stats file" << std::endl;
+            return;
+        }
+
+        o << toJson().dump(4);
         o.close();
         std::cout << "Statistics saved to " << jsonFile << std::endl;
     }
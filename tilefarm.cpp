@@ -0,0 +1,233 @@
+#include <atomic>
+#include <cstring>
+#include <omp.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "tilefarm.hpp"
+
+#define TILE_GRID 256
+
+#define TILE_PENDING 0
+#define TILE_RUNNING 1
+#define TILE_DONE 2
+
+struct TileGrid {
+    double minx, miny, cellSize;
+    int width, height;
+    std::vector<size_t> sums; // 2D prefix sums of point counts, (width + 1) x (height + 1)
+
+    inline int cellX(const float x) const { return std::min(width - 1, std::max(0, static_cast<int>((x - minx) / cellSize))); }
+    inline int cellY(const float y) const { return std::min(height - 1, std::max(0, static_cast<int>((y - miny) / cellSize))); }
+
+    // Points within cells [x0, x1) x [y0, y1)
+    size_t count(int x0, int y0, int x1, int y1) const {
+        x0 = std::max(0, x0); y0 = std::max(0, y0);
+        x1 = std::min(width, x1); y1 = std::min(height, y1);
+        if (x0 >= x1 || y0 >= y1) return 0;
+        const size_t w = width + 1;
+        return sums[y1 * w + x1] - sums[y0 * w + x1] - sums[y1 * w + x0] + sums[y0 * w + x0];
+    }
+};
+
+static void splitTiles(const TileGrid &grid, const int x0, const int y0, const int x1, const int y1,
+    const int haloCells, const size_t maxPoints, std::vector<std::array<int, 4> > &cells) {
+    if (grid.count(x0, y0, x1, y1) == 0) return;
+
+    const bool fits = grid.count(x0 - haloCells, y0 - haloCells, x1 + haloCells, y1 + haloCells) <= maxPoints;
+    if (fits || (x1 - x0 == 1 && y1 - y0 == 1)) {
+        cells.push_back({ x0, y0, x1, y1 });
+        return;
+    }
+
+    // Split along the longest side
+    if (x1 - x0 >= y1 - y0) {
+        const int mx = (x0 + x1) / 2;
+        splitTiles(grid, x0, y0, mx, y1, haloCells, maxPoints, cells);
+        splitTiles(grid, mx, y0, x1, y1, haloCells, maxPoints, cells);
+    }
+    else {
+        const int my = (y0 + y1) / 2;
+        splitTiles(grid, x0, y0, x1, my, haloCells, maxPoints, cells);
+        splitTiles(grid, x0, my, x1, y1, haloCells, maxPoints, cells);
+    }
+}
+
+std::vector<Region> planTiles(const PointSet &pSet, const size_t maxPoints, const double halo, std::vector<int> &owner) {
+    if (pSet.count() == 0) throw std::runtime_error("No points to tile");
+
+    float minx = std::numeric_limits<float>::max(), miny = minx;
+    float maxx = std::numeric_limits<float>::lowest(), maxy = maxx;
+    for (const auto &p : pSet.points) {
+        minx = std::min(minx, p[0]); maxx = std::max(maxx, p[0]);
+        miny = std::min(miny, p[1]); maxy = std::max(maxy, p[1]);
+    }
+
+    TileGrid grid;
+    grid.minx = minx;
+    grid.miny = miny;
+    grid.cellSize = std::max<double>(std::max(maxx - minx, maxy - miny) / TILE_GRID, 1e-6);
+    grid.width = std::max(1, static_cast<int>(std::ceil((maxx - minx) / grid.cellSize)));
+    grid.height = std::max(1, static_cast<int>(std::ceil((maxy - miny) / grid.cellSize)));
+
+    const size_t w = grid.width + 1;
+    grid.sums.assign(w * (grid.height + 1), 0);
+    for (const auto &p : pSet.points) grid.sums[(grid.cellY(p[1]) + 1) * w + grid.cellX(p[0]) + 1]++;
+    for (int y = 1; y <= grid.height; y++) {
+        for (int x = 1; x <= grid.width; x++) {
+            grid.sums[y * w + x] += grid.sums[(y - 1) * w + x] + grid.sums[y * w + x - 1] - grid.sums[(y - 1) * w + x - 1];
+        }
+    }
+
+    std::vector<std::array<int, 4> > cells;
+    const int haloCells = static_cast<int>(std::ceil(halo / grid.cellSize));
+    splitTiles(grid, 0, 0, grid.width, grid.height, haloCells, maxPoints, cells);
+
+    std::vector<int> cellTile(grid.width * grid.height, -1);
+    std::vector<Region> tiles;
+    for (size_t t = 0; t < cells.size(); t++) {
+        const auto &c = cells[t];
+        for (int y = c[1]; y < c[3]; y++) {
+            for (int x = c[0]; x < c[2]; x++) cellTile[y * grid.width + x] = t;
+        }
+        tiles.emplace_back(grid.minx + c[0] * grid.cellSize, grid.miny + c[1] * grid.cellSize,
+            grid.minx + c[2] * grid.cellSize, grid.miny + c[3] * grid.cellSize);
+    }
+
+    owner.resize(pSet.count());
+
+    #pragma omp parallel for
+    for (long long int i = 0; i < pSet.count(); i++) {
+        owner[i] = cellTile[grid.cellY(pSet.points[i][1]) * grid.width + grid.cellX(pSet.points[i][0])];
+    }
+
+    return tiles;
+}
+
+// Discards the logs of workers
+struct NullBuffer : std::streambuf {
+    int overflow(int c) override { return c; }
+};
+
+void classifyTiles(PointSet &pSet, const std::vector<Region> &tiles, const std::vector<int> &owner, const double halo,
+    const int numWorkers, const int retries, const bool confidence, const std::function<void(PointSet &)> &classifyTile) {
+    #ifdef _WIN32
+    throw std::runtime_error("Worker processes are not supported on Windows");
+    #else
+    const size_t numTiles = tiles.size();
+    const size_t count = pSet.count();
+
+    // Shared with the workers: queue position, queue, tile status, labels and confidence
+    const size_t queueOffset = sizeof(std::atomic<size_t>);
+    const size_t statusOffset = queueOffset + numTiles * sizeof(size_t);
+    const size_t labelsOffset = statusOffset + numTiles;
+    const size_t confidenceOffset = labelsOffset + count;
+    const size_t sharedSize = confidenceOffset + (confidence ? count * 2 : 0);
+
+    void *shared = mmap(nullptr, sharedSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) throw std::runtime_error("Cannot allocate shared memory for workers");
+
+    auto *next = new (shared) std::atomic<size_t>(0);
+    auto *queue = reinterpret_cast<size_t *>(static_cast<char *>(shared) + queueOffset);
+    auto *status = reinterpret_cast<uint8_t *>(static_cast<char *>(shared) + statusOffset);
+    auto *labels = reinterpret_cast<uint8_t *>(static_cast<char *>(shared) + labelsOffset);
+    auto *conf = reinterpret_cast<uint8_t *>(static_cast<char *>(shared) + confidenceOffset);
+    std::memset(status, TILE_PENDING, numTiles);
+
+    std::cout << "Classifying " << numTiles << " tiles with " << numWorkers << " workers" << std::endl;
+
+    for (int attempt = 0; attempt <= retries; attempt++) {
+        size_t queueSize = 0;
+        for (size_t t = 0; t < numTiles; t++) {
+            if (status[t] != TILE_DONE) {
+                status[t] = TILE_PENDING;
+                queue[queueSize++] = t;
+            }
+        }
+        if (queueSize == 0) break;
+        if (attempt > 0) std::cout << "Retrying " << queueSize << " tiles" << std::endl;
+
+        next->store(0);
+        std::cout.flush();
+        std::cerr.flush();
+
+        const int workers = std::min<int>(numWorkers, queueSize);
+        std::vector<pid_t> pids;
+        for (int w = 0; w < workers; w++) {
+            const pid_t pid = fork();
+            if (pid == -1) {
+                std::cerr << "Cannot fork worker" << std::endl;
+                break;
+            }
+
+            if (pid == 0) {
+                // OpenMP thread pools do not survive fork, workers run single threaded
+                omp_set_num_threads(1);
+                NullBuffer nullBuffer;
+                std::cout.rdbuf(&nullBuffer);
+
+                try {
+                    for (size_t q = next->fetch_add(1); q < queueSize; q = next->fetch_add(1)) {
+                        const size_t t = queue[q];
+                        status[t] = TILE_RUNNING;
+
+                        std::vector<size_t> indices;
+                        PointSet *tile = extractRegions(pSet, { tiles[t] }, halo, indices);
+                        classifyTile(*tile);
+
+                        for (size_t i = 0; i < indices.size(); i++) {
+                            const size_t idx = indices[i];
+                            if (owner[idx] != static_cast<int>(t)) continue;
+                            labels[idx] = tile->labels[i];
+                            if (confidence) {
+                                conf[idx * 2] = tile->confidence[i][0];
+                                conf[idx * 2 + 1] = tile->confidence[i][1];
+                            }
+                        }
+
+                        RELEASE_POINTSET(tile);
+                        status[t] = TILE_DONE;
+                    }
+                }
+                catch (const std::exception &e) {
+                    std::cerr << "Worker " << getpid() << " failed: " << e.what() << std::endl;
+                    _exit(EXIT_FAILURE);
+                }
+                _exit(EXIT_SUCCESS);
+            }
+
+            pids.push_back(pid);
+        }
+        if (pids.empty()) break;
+
+        int failed = 0;
+        for (const pid_t pid : pids) {
+            int wstatus = 0;
+            waitpid(pid, &wstatus, 0);
+            if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) failed++;
+        }
+
+        size_t done = 0;
+        for (size_t t = 0; t < numTiles; t++) done += status[t] == TILE_DONE ? 1 : 0;
+        std::cout << "Classified " << done << " of " << numTiles << " tiles" << (failed > 0 ? " (failed workers: " + std::to_string(failed) + ")" : "") << std::endl;
+    }
+
+    size_t incomplete = 0;
+    for (size_t t = 0; t < numTiles; t++) incomplete += status[t] != TILE_DONE ? 1 : 0;
+
+    if (incomplete == 0) {
+        pSet.labels.assign(labels, labels + count);
+        if (confidence) {
+            pSet.confidence.resize(count);
+            for (size_t i = 0; i < count; i++) pSet.confidence[i] = { conf[i * 2], conf[i * 2 + 1] };
+        }
+    }
+
+    munmap(shared, sharedSize);
+    if (incomplete > 0) throw std::runtime_error(std::to_string(incomplete) + " tiles could not be classified");
+    #endif
+}
@@ -0,0 +1,21 @@
+#ifndef TILEFARM_H
+#define TILEFARM_H
+
+#include <functional>
+#include "point_io.hpp"
+#include "region.hpp"
+
+// Approximate peak memory used to classify a point (bytes)
+#define WORKER_BYTES_PER_POINT 600
+
+// Splits pSet's XY extent into tiles so that no tile, including its halo, holds
+// more than maxPoints points. owner[i] is the tile that point i belongs to
+std::vector<Region> planTiles(const PointSet &pSet, size_t maxPoints, double halo, std::vector<int> &owner);
+
+// Classifies tiles in numWorkers forked (single threaded) processes, which share the
+// models and points of the parent. classifyTile receives the points of a tile and its halo
+// and must leave ASPRS labels in them. Tiles of workers that crash are retried
+void classifyTiles(PointSet &pSet, const std::vector<Region> &tiles, const std::vector<int> &owner, double halo,
+    int numWorkers, int retries, bool confidence, const std::function<void(PointSet &)> &classifyTile);
+
+#endif
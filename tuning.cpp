@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include "tuning.hpp"
+#include "vendor/json/json.hpp"
+
+using json = nlohmann::json;
+
+Tuning &tuning() {
+    static Tuning t;
+    return t;
+}
+
+void initTuning(const std::string &file) {
+    if (!file.empty()) {
+        loadTuning(file);
+        return;
+    }
+
+    const char *env = std::getenv("OPC_TUNING");
+    if (env != nullptr && env[0] != '\0') loadTuning(env);
+}
+
+void loadTuning(const std::string &file) {
+    std::ifstream f(file);
+    if (!f.is_open()) throw std::runtime_error("Cannot open tuning profile " + file);
+
+    json j;
+    try {
+        f >> j;
+    }
+    catch (const json::exception &e) {
+        throw std::runtime_error("Invalid tuning profile " + file + ": " + e.what());
+    }
+
+    Tuning &t = tuning();
+    if (j.contains("kdtree_leaf_size")) t.kdTreeLeafSize = std::max<size_t>(1, j["kdtree_leaf_size"].get<size_t>());
+    if (j.contains("build_schedule")) t.buildSchedule = parseSchedule(j["build_schedule"].get<std::string>());
+    if (j.contains("build_chunk")) t.buildChunk = j["build_chunk"].get<int>();
+    if (j.contains("smooth_schedule")) t.smoothSchedule = parseSchedule(j["smooth_schedule"].get<std::string>());
+    if (j.contains("smooth_chunk")) t.smoothChunk = j["smooth_chunk"].get<int>();
+
+    std::cout << "Loaded tuning profile " << file << std::endl;
+}
+
+void saveTuning(const Tuning &t, const std::string &file) {
+    std::ofstream o(file);
+    if (!o.is_open()) throw std::runtime_error("Cannot write " + file);
+
+    json j = {
+        {"kdtree_leaf_size", t.kdTreeLeafSize},
+        {"build_schedule", scheduleName(t.buildSchedule)},
+        {"build_chunk", t.buildChunk},
+        {"smooth_schedule", scheduleName(t.smoothSchedule)},
+        {"smooth_chunk", t.smoothChunk},
+        {"threads", omp_get_max_threads()}
+    };
+    o << j.dump(4);
+}
+
+std::string scheduleName(const omp_sched_t schedule) {
+    switch (schedule) {
+    case omp_sched_static: return "static";
+    case omp_sched_dynamic: return "dynamic";
+    case omp_sched_guided: return "guided";
+    default: return "auto";
+    }
+}
+
+omp_sched_t parseSchedule(const std::string &schedule) {
+    if (schedule == "static") return omp_sched_static;
+    if (schedule == "dynamic") return omp_sched_dynamic;
+    if (schedule == "guided") return omp_sched_guided;
+    if (schedule == "auto") return omp_sched_auto;
+    throw std::runtime_error("Invalid schedule: " + schedule);
+}
@@ -0,0 +1,34 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <string>
+#include <omp.h>
+
+#define KDTREE_MAX_LEAF 10
+
+// Machine specific settings, see pcautotune
+struct Tuning {
+    // Maximum number of points in kd-tree leaves
+    size_t kdTreeLeafSize = KDTREE_MAX_LEAF;
+
+    // OpenMP schedule of the neighborhood (feature) computation
+    omp_sched_t buildSchedule = omp_sched_static;
+    int buildChunk = 0;
+
+    // OpenMP schedule of local smoothing
+    omp_sched_t smoothSchedule = omp_sched_dynamic;
+    int smoothChunk = 1;
+};
+
+Tuning &tuning();
+
+// Loads a tuning profile from file, or from the OPC_TUNING
+// environment variable if file is empty (if set)
+void initTuning(const std::string &file = "");
+void loadTuning(const std::string &file);
+void saveTuning(const Tuning &t, const std::string &file);
+
+std::string scheduleName(omp_sched_t schedule);
+omp_sched_t parseSchedule(const std::string &schedule);
+
+#endif